@@ -0,0 +1,101 @@
+#!/bin/sh
+# Runs every program in this directory with every available backend
+# and prints a tab separated table on stdout:
+#
+# program mode instructions compile_ms run_ms instructions_per_s peak_rss_kb
+#
+# instructions is the number of bytecode instructions the plain
+# interpreter executes, the same for every mode, so instructions_per_s
+# can be compared directly. Each mode is run RUNS times, the fastest
+# run is reported. Partial evaluation is disabled, it would run parts
+# of the programs at compile time.
+#
+# Also generates rle.b, a large program made of long runs, which mostly
+# measures the front end (see compile_ms).
+#
+# More programs (mandelbrot.b, hanoi.b, ...) can be dropped into this
+# directory, they must not read any input.
+#
+# usage: bench.sh [path to brainfuck.c]
+# CC, CFLAGS and RUNS can be set in the environment
+
+dir=$(dirname "$0")
+src=${1:-$dir/../brainfuck.c}
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+RUNS=${RUNS:-3}
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Interpreter dispatch modes
+$CC $CFLAGS -DCOMPUTED_GOTO=0 -o "$tmp/switch" "$src" -ldl -pthread || exit 1
+$CC $CFLAGS -DCOMPUTED_GOTO=1 -o "$tmp/goto" "$src" -ldl -pthread || exit 1
+
+# About 32 MB of straight-line code, which ends up as a handful
+# of instructions (a large residual program would take the
+# system compiler ages in the aot mode)
+awk 'BEGIN {
+   for(i = 0;i<50000;i++)
+   {
+      for(j = 0;j<4;j++)
+         printf "%s", "+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++>>>>>>>>>>>>>>>>>>";
+      for(j = 0;j<4;j++)
+         printf "%s", "-----------------------------------------------------------------<<<<<<<<<<<<<<<<<<";
+      printf "\n";
+   }
+   printf ".\n";
+}' > "$tmp/rle.b"
+
+# The aot cache is kept out of the users home
+XDG_CACHE_HOME=$tmp/cache
+export XDG_CACHE_HOME
+
+printf 'program\tmode\tinstructions\tcompile_ms\trun_ms\tinstructions_per_s\tpeak_rss_kb\n'
+for prog in "$dir"/*.b "$tmp/rle.b"
+do
+   name=$(basename "$prog" .b)
+
+   "$tmp/switch" -noeval -f "$prog" -profile "$tmp/profile" < /dev/null > /dev/null
+   insts=$(awk -F'|' '$2=="TOTAL" { getline; print $1+0 }' "$tmp/profile")
+
+   for mode in switch switch-fuse goto goto-fuse jit aot
+   do
+      case $mode in
+      switch)      bin=switch; flags= ;;
+      switch-fuse) bin=switch; flags=-fuse ;;
+      goto)        bin=goto; flags= ;;
+      goto-fuse)   bin=goto; flags=-fuse ;;
+      jit)         bin=switch; flags=-jit ;;
+      aot)         bin=switch; flags=-aot ;;
+      esac
+
+      best=
+      for run in $(seq "$RUNS")
+      do
+         "$tmp/$bin" -noeval -time $flags -f "$prog" < /dev/null > /dev/null 2> "$tmp/time" || continue
+
+         # Native backends silently fall back to the interpreter
+         if [ "$mode" = jit ] || [ "$mode" = aot ]
+         then
+            grep -q "^$mode " "$tmp/time" || continue
+         fi
+
+         line=$(awk '$1=="run" { run = $2 }
+                     $1=="rss" { rss = $2 }
+                     $3=="ms"&&$1!="run" { compile+=$2 }
+                     END { printf "%.3f %.3f %d", compile, run, rss }' "$tmp/time")
+         set -- $line
+         if [ -z "$best" ] || awk "BEGIN { exit !($2<$best_run) }"
+         then
+            best=$line
+            best_run=$2
+         fi
+      done
+      [ -n "$best" ] || continue
+
+      set -- $best
+      ips=$(awk "BEGIN { printf \"%.0f\", ($2>0?$insts/($2/1000):0) }")
+      printf '%s\t%s\t%s\t%s\t%s\t%s\t%s\n' "$name" "$mode" "$insts" "$1" "$2" "$ips" "$3"
+   done
+done
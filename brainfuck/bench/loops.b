@@ -0,0 +1,4 @@
+Nested counters with small conditional loops in the innermost body
+Prints two bytes
+
+[-]++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++[>[-]++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++[>[-]++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++[>[-]++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++[>>>+[>+<->[>+++<[-]]<]>>>+++++++<<<<<<-]<-]<-]<-]>>>>>>>>.>.
@@ -0,0 +1,4 @@
+Scans back and forth with strides 1 and 2 over a row of 16001 nonzero cells
+Prints a single byte
+
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++>>>>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]>++++++++++[<+++++++++++++++++++++++++>-]<[[->+<]+>-]+><[<]<<[>++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++[>>>[>>]<<[<<]>[>]<[<]<-]<-]>>>.
@@ -9,10 +9,33 @@ You should have received a copy of the CC0 Public Domain Dedication along with t
 */
 
 //External includes
+//memrchr() is a GNU extension
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#if defined(__unix__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 //-------------------------------------
 
 //Internal includes
@@ -25,8 +48,67 @@ You should have received a copy of the CC0 Public Domain Dedication along with t
 //Memory size
 #define MEM_SIZE (1<<24)
 
+//Guard page backed tape (64 bit unix only):
+//TAPE_SIZE cells are reserved, the pointer starts in the middle,
+//only the used part is made accessible (see tape_fault())
+//The guard regions on both sides are larger than any
+//32 bit instruction offset, so every access that
+//leaves the tape is caught
+#ifndef GUARD_TAPE
+#if defined(__unix__)&&UINTPTR_MAX==UINT64_MAX
+#define GUARD_TAPE 1
+#else
+#define GUARD_TAPE 0
+#endif
+#endif
+#define TAPE_SIZE (1ll<<30)
+#define TAPE_GUARD (1ll<<31)
+#define TAPE_COMMIT (1<<16)
+
+//Size of the input/output buffers
+#define IO_BUFFER_SIZE (1<<16)
+
+//Partial evaluation (see partial_eval()):
+//maximum number of instructions executed at compile time
+//and size of the tape used for it
+#define EVAL_STEPS (1<<22)
+#define EVAL_TAPE (1<<16)
+
 //GCC-only optimization
+#ifndef COMPUTED_GOTO
 #define COMPUTED_GOTO 0
+#endif
+
+//x86-64 native code backend (-jit),
+//needs mmap() for executable memory
+#ifndef JIT
+#if defined(__x86_64__)&&defined(__unix__)
+#define JIT 1
+#else
+#define JIT 0
+#endif
+#endif
+
+//Ahead of time compilation through the system C compiler (-aot),
+//needs dlopen() for loading the result
+#ifndef AOT
+#if defined(__unix__)
+#define AOT 1
+#else
+#define AOT 0
+#endif
+#endif
+
+//Bump when the C emitted for -aot changes,
+//invalidates previously cached objects
+#define AOT_VERSION 2
+
+//Programs kept compiled by -serve (see -cache)
+#define SERVE_CACHE 64
+
+//Bump when opcodes or their operands change,
+//-load-bc refuses files of other versions
+#define BYTECODE_VERSION 1
 
 //Macros:
 
@@ -35,44 +117,67 @@ You should have received a copy of the CC0 Public Domain Dedication along with t
 
 #define ABS(a) ((a)<0?(-a):(a))
 
+//32 bit operand stored in bytecode
+#define ARG32(p) (*((int32_t *)(p)))
+
+#define OP_COUNT (sizeof(op_size)/sizeof(*op_size))
+
 //Hacky remapping
 #if !COMPUTED_GOTO
 #define case_OP_PTR case OP_PTR
 #define case_OP_VAL case OP_VAL
-#define case_OP_VAL_OFF case OP_VAL_OFF
+#define case_OP_SET case OP_SET
 #define case_OP_GET_VAL case OP_GET_VAL
-#define case_OP_GET_VAL_OFF case OP_GET_VAL_OFF
 #define case_OP_PUT_VAL case OP_PUT_VAL
-#define case_OP_PUT_VAL_OFF case OP_PUT_VAL_OFF
-#define case_OP_CLEAR case OP_CLEAR
-#define case_OP_CLEAR_OFF case OP_CLEAR_OFF
+#define case_OP_MUL_ADD case OP_MUL_ADD
+#define case_OP_SCAN case OP_SCAN
 #define case_OP_WHILE_START case OP_WHILE_START
 #define case_OP_WHILE_END case OP_WHILE_END
 #define case_OP_EXIT case OP_EXIT
+#define case_OP_WRITE case OP_WRITE
+#define case_OP_LOAD case OP_LOAD
+#define case_OP_PTR_WHILE_START case OP_PTR_WHILE_START
+#define case_OP_PTR_WHILE_END case OP_PTR_WHILE_END
+#define case_OP_SET_PTR case OP_SET_PTR
+#define case_OP_VAL_PTR case OP_VAL_PTR
+#define case_OP_MUL_ADD_SET case OP_MUL_ADD_SET
 #endif
 //-------------------------------------
 
 //Typedefs
+//Instructions that access cells carry the offset
+//of the cell relative to ptr as their first operand,
+//all operands are 32 bit except for cell values
 typedef enum 
 {
-   OP_PTR = 0,
+   OP_PTR = 0,         //int32 delta
+
+   OP_VAL = 1,         //int32 off, uint8 val
+   OP_SET = 2,         //int32 off, uint8 val
 
-   OP_VAL = 1,
-   OP_VAL_OFF = 2,
+   OP_GET_VAL = 3,     //int32 off
+   OP_PUT_VAL = 4,     //int32 off
 
-   OP_GET_VAL = 3,
-   OP_GET_VAL_OFF = 4,
+   OP_MUL_ADD = 5,     //int32 off, int32 dst, uint8 k
 
-   OP_PUT_VAL = 5,
-   OP_PUT_VAL_OFF = 6,
+   OP_SCAN = 6,        //int32 stride
 
-   OP_CLEAR = 7,
-   OP_CLEAR_OFF = 8,
+   OP_WHILE_START = 7, //int32 target
+   OP_WHILE_END = 8,   //int32 target
 
-   OP_WHILE_START = 9,
-   OP_WHILE_END = 10,
+   OP_EXIT = 9,
 
-   OP_EXIT = 11,
+   //Result of partial_eval(), the bytes are stored in Bytecode.data
+   OP_WRITE = 10,      //int32 data, int32 len
+   OP_LOAD = 11,       //int32 off, int32 data, int32 len
+
+   //Superinstructions (-fuse), the operands of both
+   //instructions are stored back to back, see op_fused
+   OP_PTR_WHILE_START = 12,
+   OP_PTR_WHILE_END = 13,
+   OP_SET_PTR = 14,
+   OP_VAL_PTR = 15,
+   OP_MUL_ADD_SET = 16,
 }Opcode;
 
 typedef struct
@@ -80,27 +185,378 @@ typedef struct
    uint8_t *code;
    unsigned code_used;
    unsigned code_size;
+
+   //Constant data referenced by OP_WRITE/OP_LOAD
+   uint8_t *data;
+   unsigned data_used;
+   unsigned data_size;
+
+   //Mapping code and data point into if
+   //loaded by bytecode_load(), read-only
+   void *map;
+   size_t map_size;
 }Bytecode;
+
+//Header of -emit-bc files, followed by code and data
+//Everything is stored in native byte order
+typedef struct
+{
+   char magic[4]; //"BFBC"
+   uint32_t version;
+   uint32_t code_used;
+   uint32_t data_used;
+}BytecodeHeader;
+
+//Loop opened by a '[' that hasn't been closed yet, see compile()
+typedef struct
+{
+   size_t source;  //offset of the '[' in the source
+   unsigned start; //offset of the OP_WHILE_START
+   unsigned block; //state of the block in front of the loop
+   unsigned merge;
+   int32_t pos;
+}CompileLoop;
+
+//Compile time execution state, see partial_eval()
+typedef struct
+{
+   uint8_t tape[EVAL_TAPE];
+   int32_t pos;
+
+   uint8_t *out;
+   unsigned out_used;
+   unsigned out_size;
+}Eval;
+
+//Buffered input/output of the running program
+typedef struct
+{
+   //Output is only written to stdout when
+   //input is needed, the buffer is full or the program exits
+   //(or after each newline if line buffered)
+   FILE *output;
+   uint8_t out[IO_BUFFER_SIZE];
+   unsigned out_used;
+   int line_buffered;
+
+   //Every block written is preceded by its
+   //length (uint32_t), for -serve connections
+   int framed;
+
+   //Input is either read in blocks into in[],
+   //or the whole file is mapped (regular files only)
+   //No input at all if NULL
+   FILE *input;
+   uint8_t in[IO_BUFFER_SIZE];
+   const uint8_t *in_pos;
+   const uint8_t *in_end;
+   uint8_t *in_map;
+   size_t in_map_size;
+}Io;
+
+//State of a running program
+//Any number of these can run the same
+//Bytecode/Jit/Aot at once
+typedef struct
+{
+   uint8_t *ptr;
+   uint8_t *tape_start;
+   uint8_t *tape_end;
+
+#if GUARD_TAPE
+   //Accessible part of the tape, see tape_fault()
+   uint8_t *tape_lo;
+   uint8_t *tape_hi;
+
+   //Out of range tape accesses jump here,
+   //fault_cell is the accessed cell relative to the start
+   sigjmp_buf fault;
+   int64_t fault_cell;
+#else
+   uint8_t *mem;
+#endif
+
+   Io io;
+}Vm;
+
+typedef struct
+{
+   uint8_t *code;
+   unsigned code_used;
+   unsigned code_size;
+
+   //Executable copy of code, see jit_compile()
+   uint8_t *(*entry)(uint8_t *ptr, Vm *vm);
+   size_t entry_size;
+}Jit;
+
+typedef struct
+{
+   //Loaded shared object, see aot_compile()
+   void *handle;
+   uint8_t *(*entry)(uint8_t *ptr, void *io, int (*get)(void *io), void (*put)(void *io, int c));
+}Aot;
+
+typedef enum
+{
+   BACKEND_INTERPRETER,
+   BACKEND_JIT,
+   BACKEND_AOT,
+}Backend;
+
+//Compiled program, never modified while running
+typedef struct
+{
+   Bytecode code;
+   Backend backend;
+   Jit native;
+   Aot compiled;
+}Program;
+
+//-batch job list, workers take jobs in order
+typedef struct
+{
+   int jobs_used;
+   char **program;
+   char **input;
+   char **output;
+   Program **compiled;
+
+   int next;
+   int failed;
+#if defined(__unix__)
+   pthread_mutex_t lock;
+#endif
+   int line_buffered;
+}Batch;
+
+//-serve protocol, integers in native byte order
+//Request: ServeRequest, the source (if SERVE_SOURCE is set),
+//then the input of the program until the client shuts
+//down its side of the connection
+//Response: ServeResponse, if the status is SERVE_OK followed by the
+//output in blocks (uint32_t length, data) and a zero length
+//block followed by ServeResult once the program has ended
+typedef enum
+{
+   SERVE_SOURCE = 1, //source follows, otherwise only hash is used
+   SERVE_LINE = 2,   //flush output after every newline
+}ServeFlag;
+
+typedef enum
+{
+   SERVE_OK,
+   SERVE_UNKNOWN, //hash not cached, send the source
+   SERVE_INVALID, //malformed request or source doesn't compile
+}ServeStatus;
+
+typedef enum
+{
+   SERVE_DONE,
+   SERVE_FAULT,   //out of range tape access
+   SERVE_NO_TAPE, //failed to allocate tape
+}ServeEnd;
+
+typedef struct
+{
+   char magic[4]; //"BFRQ"
+   uint32_t flags;
+   uint64_t hash; //source_hash() of the source
+   uint64_t source_len;
+}ServeRequest;
+
+typedef struct
+{
+   char magic[4]; //"BFRS"
+   uint32_t status;
+}ServeResponse;
+
+typedef struct
+{
+   uint32_t status;
+   int64_t fault_cell;
+}ServeResult;
+
+#if defined(__unix__)
+typedef struct
+{
+   uint64_t hash;
+   Program *prog;
+   int users; //connections running prog, can't be evicted while non-zero
+   uint64_t used; //clock value of the last use
+}ServeEntry;
+
+typedef struct
+{
+   ServeEntry *cache;
+   int cache_used;
+   int cache_size;
+   int cache_max;
+   uint64_t clock;
+   pthread_mutex_t lock;
+
+   Backend backend;
+   int eval;
+   int superinstructions;
+}Server;
+
+typedef struct
+{
+   Server *server;
+   int fd;
+}ServeConnection;
+
+typedef struct
+{
+   int fd;
+   FILE *input;
+}ServePump;
+#endif
 //-------------------------------------
 
 //Variables
-static uint8_t mem[MEM_SIZE] = {0};
-static uint8_t *ptr = mem;
+#if GUARD_TAPE
+//Vm running on this thread, for tape_fault()
+static _Thread_local Vm *vm_current = NULL;
+#endif
+
+#if AOT
+//Makes temporary file names of aot_compile() unique within the process
+static atomic_uint aot_tmp_counter = 0;
+#endif
+
+//Size of each instruction in bytes, including the opcode
+static const uint8_t op_size[] = 
+{
+   5, //OP_PTR
+   6, //OP_VAL
+   6, //OP_SET
+   5, //OP_GET_VAL
+   5, //OP_PUT_VAL
+   10, //OP_MUL_ADD
+   5, //OP_SCAN
+   5, //OP_WHILE_START
+   5, //OP_WHILE_END
+   1, //OP_EXIT
+   9, //OP_WRITE
+   13, //OP_LOAD
+   9, //OP_PTR_WHILE_START
+   9, //OP_PTR_WHILE_END
+   10, //OP_SET_PTR
+   10, //OP_VAL_PTR
+   15, //OP_MUL_ADD_SET
+};
+
+//Instructions each superinstruction is made of,
+//picked from the most common pairs reported by -profile
+static const uint8_t op_fused[][2] =
+{
+   {OP_PTR,OP_WHILE_START},
+   {OP_PTR,OP_WHILE_END},
+   {OP_SET,OP_PTR},
+   {OP_VAL,OP_PTR},
+   {OP_MUL_ADD,OP_SET},
+};
+
+static const char *op_name[] =
+{
+   "PTR",
+   "VAL",
+   "SET",
+   "GET_VAL",
+   "PUT_VAL",
+   "MUL_ADD",
+   "SCAN",
+   "WHILE",
+   "ELIHW",
+   "EXIT",
+   "WRITE",
+   "LOAD",
+   "PTR_WHILE",
+   "PTR_ELIHW",
+   "SET_PTR",
+   "VAL_PTR",
+   "MUL_ADD_SET",
+};
 //-------------------------------------
 
 //Function prototypes
-static void compile(FILE *in, Bytecode *code);
-static void optimize(Bytecode *code);
+static int  compile(const uint8_t *src, size_t len, Bytecode *code);
+static void compile_val(Bytecode *code, unsigned merge, uint8_t op, int32_t off, uint8_t val);
+static void fuse(Bytecode *code);
+static void partial_eval(Bytecode *code);
+static void partial_eval_run(const Bytecode *code, Eval *eval, uint64_t steps, const uint8_t *top, unsigned *cut, uint64_t *cut_steps);
 static void print_help(char **argv);
 
 static void bytecode_init(Bytecode *code);
 static void bytecode_write(Bytecode *code, uint8_t byte);
+static void bytecode_write32(Bytecode *code, int32_t val);
+static int32_t bytecode_data(Bytecode *code, const uint8_t *data, unsigned len);
 static void bytecode_free(Bytecode *code);
-static void bytecode_disassemble(const Bytecode *code);
-static void bytecode_run(const Bytecode *code, FILE *input);
+static void bytecode_link(Bytecode *code);
+static int  bytecode_save(const Bytecode *code, const char *path);
+static int  bytecode_load(Bytecode *code, const char *path);
+static void bytecode_disassemble(const Bytecode *code, FILE *out, const uint64_t *counts);
+static void bytecode_run(const Bytecode *code, Vm *vm);
+static void bytecode_profile(const Bytecode *code, Vm *vm, FILE *report);
+static int  profile_cmp(const void *a, const void *b);
+static uint8_t *scan(const Vm *vm, uint8_t *ptr, int stride);
+
+static int  program_load(Program *prog, const char *path, int bytecode, Backend backend, int eval, int superinstructions, int timing);
+static int  program_run(const Program *prog, Vm *vm);
+static int  program_compile(Program *prog, const uint8_t *src, size_t len, Backend backend, int eval, int superinstructions, int timing);
+static void program_backend(Program *prog, Backend backend, int superinstructions, int timing, double t);
+static void program_free(Program *prog);
+static uint8_t *source_read(const char *path, size_t *len, int *mapped);
+static void source_free(uint8_t *src, size_t len, int mapped);
+static double time_now(void);
+static double time_report(const char *stage, double start);
+
+static int  batch_load(Batch *batch, const char *path, Backend backend, int eval, int superinstructions);
+static void batch_run(Batch *batch, int threads);
+static void *batch_worker(void *arg);
+static void batch_free(Batch *batch);
+
+static uint64_t source_hash(const uint8_t *src, size_t len);
+static int  serve(const char *path, int cache_max, Backend backend, int eval, int superinstructions);
+static int  serve_connect(const char *socket_path, const char *path, const char *path_io, int line_buffered);
+#if defined(__unix__)
+static void *serve_connection(void *arg);
+static Program *serve_acquire(Server *server, const ServeRequest *req, const uint8_t *src, uint32_t *status);
+static Program *serve_find(Server *server, uint64_t hash);
+static void serve_release(Server *server, Program *prog);
+static void *serve_pump(void *arg);
+static int  serve_read(int fd, void *buffer, size_t len);
+static int  serve_write(int fd, const void *buffer, size_t len);
+#endif
+
+static int  vm_init(Vm *vm, FILE *input, FILE *output, int line_buffered);
+static void vm_free(Vm *vm);
+#if GUARD_TAPE
+static void tape_fault(int sig, siginfo_t *info, void *context);
+#endif
 
 static void dump_bf(const Bytecode *code);
-static void dump_c(const Bytecode *code);
+static void dump_bf_move(int32_t *pos, int32_t to);
+static void dump_c(const Bytecode *code, FILE *out, int aot);
+
+static int  jit_compile(const Bytecode *code, Jit *jit);
+static void jit_run(const Jit *jit, Vm *vm);
+static void jit_free(Jit *jit);
+
+static int  aot_compile(const Bytecode *code, Aot *aot);
+static void aot_run(const Aot *aot, Vm *vm);
+static void aot_free(Aot *aot);
+static uint64_t bytecode_hash(const Bytecode *code);
+
+static void io_init(Io *io, FILE *input, FILE *output, int line_buffered);
+static int  io_get(Io *io);
+static int  io_read(Io *io);
+static void io_put(Io *io, uint8_t c);
+static void io_write(Io *io, const uint8_t *data, unsigned len);
+static void io_flush(Io *io);
+static void io_emit(Io *io, const uint8_t *data, unsigned len);
+static void io_free(Io *io);
 //-------------------------------------
 
 //Function implementations
@@ -111,6 +567,20 @@ int main(int argc, char *argv[])
    const char *path = NULL;
    const char *path_io = NULL;
    const char *dump = NULL;
+   int jit = 0;
+   int aot = 0;
+   const char *profile = NULL;
+   int superinstructions = 0;
+   int line_buffered = 0;
+   int eval = 1;
+   const char *batch = NULL;
+   int threads = 0;
+   int bytecode = 0;
+   const char *emit = NULL;
+   int timing = 0;
+   const char *serve_path = NULL;
+   const char *connect_path = NULL;
+   int cache = 0;
    for(int i = 1;i<argc;i++)
    {
       if(strcmp(argv[i],"--help")==0||
@@ -120,10 +590,76 @@ int main(int argc, char *argv[])
          print_help(argv);
       else if(strcmp(argv[i],"-f")==0)
          path = READ_ARG(i);
+      else if(strcmp(argv[i],"-load-bc")==0)
+      {
+         path = READ_ARG(i);
+         bytecode = 1;
+      }
+      else if(strcmp(argv[i],"-emit-bc")==0)
+         emit = READ_ARG(i);
       else if(strcmp(argv[i],"-i")==0)
          path_io = READ_ARG(i);
       else if(strcmp(argv[i],"-dump")==0)
          dump = READ_ARG(i);
+      else if(strcmp(argv[i],"-jit")==0)
+         jit = 1;
+      else if(strcmp(argv[i],"-aot")==0)
+         aot = 1;
+      else if(strcmp(argv[i],"-profile")==0)
+         profile = READ_ARG(i);
+      else if(strcmp(argv[i],"-fuse")==0)
+         superinstructions = 1;
+      else if(strcmp(argv[i],"-line")==0)
+         line_buffered = 1;
+      else if(strcmp(argv[i],"-noeval")==0)
+         eval = 0;
+      else if(strcmp(argv[i],"-time")==0)
+         timing = 1;
+      else if(strcmp(argv[i],"-serve")==0)
+         serve_path = READ_ARG(i);
+      else if(strcmp(argv[i],"-connect")==0)
+         connect_path = READ_ARG(i);
+      else if(strcmp(argv[i],"-cache")==0)
+      {
+         const char *arg = READ_ARG(i);
+         cache = arg==NULL?0:atoi(arg);
+      }
+      else if(strcmp(argv[i],"-batch")==0)
+         batch = READ_ARG(i);
+      else if(strcmp(argv[i],"-threads")==0)
+      {
+         const char *arg = READ_ARG(i);
+         threads = arg==NULL?0:atoi(arg);
+      }
+   }
+
+   Backend backend = BACKEND_INTERPRETER;
+   if(jit)
+      backend = BACKEND_JIT;
+   else if(aot)
+      backend = BACKEND_AOT;
+
+   if(batch!=NULL)
+   {
+      Batch jobs = {0};
+      if(batch_load(&jobs,batch,backend,eval,superinstructions))
+      {
+         printf("Failed to read batch file %s\n",batch);
+         return 0;
+      }
+      jobs.line_buffered = line_buffered;
+      batch_run(&jobs,threads);
+      int failed = jobs.failed;
+      batch_free(&jobs);
+
+      return failed>0;
+   }
+
+   if(serve_path!=NULL)
+   {
+      serve(serve_path,cache,backend,eval,superinstructions);
+      printf("Failed to listen on %s\n",serve_path);
+      return 1;
    }
 
    if(path==NULL)
@@ -132,288 +668,599 @@ int main(int argc, char *argv[])
       return 0;
    }
 
-   //Compile code
-   Bytecode code = {0};
-   bytecode_init(&code);
-   FILE *in = fopen(path,"r");
-   compile(in,&code);
-   fclose(in);
-
-   //Performe some optimizations
-   optimize(&code);
+   if(connect_path!=NULL)
+      return serve_connect(connect_path,path,path_io,line_buffered);
 
    //Dump code in desired format (if at all) and terminate after
+   //bf has no way of expressing partial evaluation,
+   //superinstructions are only shown in the IR
+   Program prog;
    if(dump!=NULL)
    {
+      if(program_load(&prog,path,bytecode,BACKEND_INTERPRETER,eval&&strcmp(dump,"bf")!=0,superinstructions&&strcmp(dump,"IR")==0,timing))
+      {
+         printf(bytecode?"Failed to load bytecode file %s\n":"Failed to compile file %s\n",path);
+         return 0;
+      }
+
       if(strcmp(dump,"IR")==0)
-         bytecode_disassemble(&code);
+         bytecode_disassemble(&prog.code,stdout,NULL);
       else if(strcmp(dump,"bf")==0)
-         dump_bf(&code);
+         dump_bf(&prog.code);
       else if(strcmp(dump,"C")==0)
-         dump_c(&code);
+         dump_c(&prog.code,stdout,0);
+
+      program_free(&prog);
+      return 0;
+   }
+
+   //Store the bytecode before any backend specific changes
+   if(emit!=NULL)
+   {
+      if(program_load(&prog,path,bytecode,BACKEND_INTERPRETER,eval,0,timing))
+      {
+         printf(bytecode?"Failed to load bytecode file %s\n":"Failed to compile file %s\n",path);
+         return 0;
+      }
+
+      if(bytecode_save(&prog.code,emit))
+         printf("Failed to write bytecode to %s\n",emit);
+
+      program_free(&prog);
+      return 0;
+   }
 
+   //The profiler only understands plain bytecode
+   if(profile!=NULL)
+   {
+      backend = BACKEND_INTERPRETER;
+      superinstructions = 0;
+   }
+   if(program_load(&prog,path,bytecode,backend,eval,superinstructions,timing))
+   {
+      printf(bytecode?"Failed to load bytecode file %s\n":"Failed to compile file %s\n",path);
       return 0;
    }
 
    //Change input stream if specified in arguments
    FILE *input = stdin;
    if(path_io!=NULL)
-      input = fopen(path_io,"r");
+      input = fopen(path_io,"rb");
+   if(input==NULL)
+   {
+      printf("Failed to open input file %s\n",path_io);
+      return 0;
+   }
+
+   static Vm vm;
+   if(vm_init(&vm,input,stdout,line_buffered))
+   {
+      printf("Failed to allocate tape\n");
+      return 0;
+   }
 
    //Run code
-   bytecode_run(&code,input);
+   int status = 0;
+   double t = time_now();
+   if(profile!=NULL)
+   {
+      FILE *report = fopen(profile,"w");
+      bytecode_profile(&prog.code,&vm,report);
+      fclose(report);
+   }
+   else if(program_run(&prog,&vm))
+   {
+#if GUARD_TAPE
+      fprintf(stderr,"Tape access out of range (cell %"PRId64")\n",vm.fault_cell);
+#endif
+      status = 1;
+   }
+   if(timing)
+   {
+      time_report("run",t);
+#if defined(__unix__)
+      struct rusage usage;
+      if(getrusage(RUSAGE_SELF,&usage)==0)
+         fprintf(stderr,"%-10s %10ld kB\n","rss",usage.ru_maxrss);
+#endif
+   }
 
    //Cleanup
-   bytecode_free(&code);
+   vm_free(&vm);
+   if(input!=stdin)
+      fclose(input);
+   program_free(&prog);
 
-   return 0;
+   return status;
 }
 
-static void compile(FILE *in, Bytecode *code)
+//Single pass front end
+//Translates the source straight into optimized bytecode,
+//every instruction is looked at a constant amount of times,
+//so compile time is linear in the size of the source:
+//
+//rle: additions and subtractions of pointer/value get rle encoded,
+//i.e.: +++++++ gets converted to *ptr+=7, runs that cancel out are dropped
+//
+//offsets: pointer movement inside of a straight-line block
+//(everything between brackets and scans) gets folded into the
+//offsets of the instructions, leaving a single pointer adjustment
+//at the end of the block
+//i.e.: >+>>-<. gets converted to
+//*(ptr+1)+=1;*(ptr+3)-=1;putchar(*(ptr+2));ptr+=2;
+//Additions/sets of the same cell get merged if
+//only other cells are modified in between,
+//[-]+++ becomes a single set this way
+//
+//patterns: checked when a loop gets closed, only the body of the
+//innermost loop is looked at, which is already in its final form
+//[-] Clears the cell to zero
+//[->+>+++<<] Multiplication/copy loops, loops without
+//any io or nested loops, that don't move the pointer in
+//total and change the loop cell by an odd amount, run a fixed
+//amount of times and get replaced by cell[off]+=cell[0]*k for
+//each touched cell, followed by a clear
+//[>] [<<] Scans for the next zero cell with a fixed stride
+//
+//while: brackets are matched with an explicit stack and
+//linked as soon as the ']' is read
+static int compile(const uint8_t *src, size_t len, Bytecode *code)
 {
-   while(!feof(in)&&!ferror(in))
+   int loops_used = 0;
+   int loops_size = 16;
+   CompileLoop *loops = malloc(sizeof(*loops)*loops_size);
+   int32_t pos = 0;
+   int val = 0;
+   unsigned merge = 0;
+
+   for(size_t i = 0;i<=len;i++)
    {
-      switch(fgetc(in))
-      {
-      case '>': bytecode_write(code,OP_PTR); bytecode_write(code,1); break;
-      case '<': bytecode_write(code,OP_PTR); bytecode_write(code,-1); break;
-      case '+': bytecode_write(code,OP_VAL); bytecode_write(code,1); break;
-      case '-': bytecode_write(code,OP_VAL); bytecode_write(code,-1); break;
-      case ',': bytecode_write(code,OP_GET_VAL); break;
-      case '.': bytecode_write(code,OP_PUT_VAL); break;
-      case '[': bytecode_write(code,OP_WHILE_START); bytecode_write(code,0); bytecode_write(code,0); bytecode_write(code,0); bytecode_write(code,0); break;
-      case ']': bytecode_write(code,OP_WHILE_END); bytecode_write(code,0); bytecode_write(code,0); bytecode_write(code,0); bytecode_write(code,0); break;
-      }
-   }
-
-   bytecode_write(code,OP_EXIT);
-}
-
-static void optimize(Bytecode *code)
-{
-   unsigned fast = 0;
-   unsigned end = 0;
-   int arg = 0;
+      int c = i<len?src[i]:EOF;
 
-   //Pass 1 --> rle
-   //Additions and subtractions of pointer/value
-   //get rle encoded
-   //i.e.: +++++++ gets converted to *ptr+=7
-   end = code->code_used;
-   code->code_used = 0;
-   for(fast = 0;fast<end;)
-   {
-      switch(code->code[fast])
+      //Comments don't end a run of additions
+      if(c=='+'||c=='-')
       {
-      case OP_PTR:
-         arg = 0;
-         while(code->code[fast]==OP_PTR&&arg!=INT8_MIN&&arg!=INT8_MAX) { arg+=(int8_t)code->code[fast+1]; fast+=2; }
-         bytecode_write(code,OP_PTR);
-         bytecode_write(code,arg);
-         break;
-      case OP_VAL:
-         arg = 0;
-         while(code->code[fast]==OP_VAL&&arg!=INT8_MIN&&arg!=INT8_MAX) { arg+=(int8_t)code->code[fast+1]; fast+=2; }
-         bytecode_write(code,OP_VAL);
-         bytecode_write(code,arg);
-         break;
-      case OP_GET_VAL:
-      case OP_PUT_VAL:
-      case OP_EXIT:
-         bytecode_write(code,code->code[fast++]);
-         break;
-      case OP_WHILE_START:
-      case OP_WHILE_END:
-         bytecode_write(code,code->code[fast++]);
-         bytecode_write(code,code->code[fast++]);
-         bytecode_write(code,code->code[fast++]);
-         bytecode_write(code,code->code[fast++]);
-         bytecode_write(code,code->code[fast++]);
-         break;
+         val+=c=='+'?1:-1;
+         continue;
       }
-   }
-   //-------------------------------------
+      if(c!='<'&&c!='>'&&c!=','&&c!='.'&&c!='['&&c!=']'&&c!=EOF)
+         continue;
+      if((uint8_t)val!=0)
+         compile_val(code,merge,OP_VAL,pos,val);
+      val = 0;
 
-   //Pass 2 --> common patterns
-   //Some snippets of code are reused often
-   //Some of these get taken care of here
-   //Currently implemented:
-   //[-] Clears the cell to zero
-   end = code->code_used;
-   code->code_used = 0;
-   for(fast = 0;fast<end;)
-   {
-      if(fast<end-12&&code->code[fast]==OP_WHILE_START&&code->code[fast+5]==OP_VAL&&code->code[fast+7]==OP_WHILE_END)
+      switch(c)
       {
-         bytecode_write(code,OP_CLEAR);
-         fast+=12;
-      }
-      else
-      {
-         switch(code->code[fast])
+      case '>': pos++; break;
+      case '<': pos--; break;
+      case ',':
+      case '.':
+         bytecode_write(code,c==','?OP_GET_VAL:OP_PUT_VAL);
+         bytecode_write32(code,pos);
+         merge = code->code_used;
+         break;
+      case '[':
+         if(loops_used==loops_size)
          {
-         case OP_GET_VAL:
-         case OP_PUT_VAL:
-         case OP_EXIT:
-            bytecode_write(code,code->code[fast++]);
-            break;
-         case OP_VAL:
-         case OP_PTR:
-            bytecode_write(code,code->code[fast++]);
-            bytecode_write(code,code->code[fast++]);
-            break;
-         case OP_WHILE_START:
-         case OP_WHILE_END:
-            bytecode_write(code,code->code[fast++]);
-            bytecode_write(code,code->code[fast++]);
-            bytecode_write(code,code->code[fast++]);
-            bytecode_write(code,code->code[fast++]);
-            bytecode_write(code,code->code[fast++]);
-            break;
+            loops_size*=2;
+            loops = realloc(loops,sizeof(*loops)*loops_size);
          }
-      }
-   }
-   //-------------------------------------
 
-   //Pass 3 --> offsets
-   //Sometimes the pointer gets moved to
-   //a specific location and back for a single command,
-   //this makes such occurrences execute
-   //as a single execution
-   //Currently implemented: '+';',';'.';'[-]'
-   end = code->code_used;
-   code->code_used = 0;
-   for(fast = 0;fast<end;)
-   {
-      if(fast<end-5&&code->code[fast]==OP_PTR&&code->code[fast+2]!=OP_WHILE_START&&code->code[fast+2]!=OP_WHILE_END&&code->code[fast+2]!=OP_PTR&&code->code[fast+2]!=OP_VAL&&code->code[fast+3]==OP_PTR&&((int)(int8_t)code->code[fast+1])==-((int)(int8_t)code->code[fast+4]))
-      {
-         switch(code->code[fast+2])
+         //Everything needed to undo the '[' if the
+         //loop turns out to be a multiplication
+         loops[loops_used].source = i;
+         loops[loops_used].block = code->code_used;
+         loops[loops_used].pos = pos;
+         loops[loops_used].merge = merge;
+         if(pos!=0)
          {
-         case OP_CLEAR: bytecode_write(code,OP_CLEAR_OFF); bytecode_write(code,code->code[fast+1]); break;
-         case OP_GET_VAL: bytecode_write(code,OP_GET_VAL_OFF); bytecode_write(code,code->code[fast+1]); break;
-         case OP_PUT_VAL: bytecode_write(code,OP_PUT_VAL_OFF); bytecode_write(code,code->code[fast+1]); break;
+            bytecode_write(code,OP_PTR);
+            bytecode_write32(code,pos);
+            pos = 0;
          }
-         fast+=5;
-      }
-      else if(fast<end-6&&code->code[fast]==OP_PTR&&code->code[fast+2]==OP_VAL&&code->code[fast+4]==OP_PTR&&((int)(int8_t)code->code[fast+1])==-((int)(int8_t)code->code[fast+5]))
-      {
-         bytecode_write(code,OP_VAL_OFF);
-         bytecode_write(code,code->code[fast+1]);
-         bytecode_write(code,code->code[fast+3]);
-         fast+=6;
-      }
-      else
+         loops[loops_used++].start = code->code_used;
+         bytecode_write(code,OP_WHILE_START);
+         bytecode_write32(code,0);
+         merge = code->code_used;
+         break;
+      case ']':
       {
-         switch(code->code[fast])
+         if(loops_used==0)
          {
-         case OP_VAL:
-         case OP_PTR:
-            bytecode_write(code,code->code[fast++]);
-            bytecode_write(code,code->code[fast++]);
-            break;
-         case OP_GET_VAL:
-         case OP_PUT_VAL:
-         case OP_CLEAR:
-         case OP_EXIT:
-            bytecode_write(code,code->code[fast++]);
-            break;
-         case OP_WHILE_START:
-         case OP_WHILE_END:
-            bytecode_write(code,code->code[fast++]);
-            bytecode_write(code,code->code[fast++]);
-            bytecode_write(code,code->code[fast++]);
-            bytecode_write(code,code->code[fast++]);
-            bytecode_write(code,code->code[fast++]);
-            break;
+            fprintf(stderr,"Unmatched ']' at byte %zu\n",i);
+            free(loops);
+            return 1;
          }
-      }
-   }
-   //-------------------------------------
+         CompileLoop *loop = &loops[--loops_used];
+         unsigned body = loop->start+5;
 
-   //Pass 4 --> while
-   //Find matching brackets
-   //and store their positions
-   //Needs to be done last
-   //since memory layout of instructions
-   //changes in previous passes
-   end = code->code_used;
-   for(fast = 0;fast<end;)
-   {
-      if(code->code[fast]==OP_WHILE_START)
-      {
-         int sptr = fast+5;
-         int balance = 1;
+         //Scan: the body is nothing but pointer movement
+         if(code->code_used==body&&pos!=0)
+         {
+            code->code_used = loop->start;
+            bytecode_write(code,OP_SCAN);
+            bytecode_write32(code,pos);
+            pos = 0;
+            merge = code->code_used;
+            break;
+         }
 
-         while(balance)
+         //Multiplication: the body is nothing but additions
+         int mul_used = 0;
+         int32_t mul_off[64];
+         uint8_t mul_val[64];
+         unsigned m;
+         for(m = body;pos==0&&m<code->code_used&&code->code[m]==OP_VAL;m+=6)
          {
-            switch(code->code[sptr])
+            int32_t off = ARG32(&code->code[m+1]);
+            int e;
+            for(e = 0;e<mul_used&&mul_off[e]!=off;e++);
+            if(e==mul_used)
             {
-            case OP_VAL:
-            case OP_PTR:
-            case OP_CLEAR_OFF:
-            case OP_GET_VAL_OFF:
-            case OP_PUT_VAL_OFF:
-               sptr+=2;
-               break;
-            case OP_GET_VAL:
-            case OP_PUT_VAL:
-            case OP_CLEAR:
-            case OP_EXIT:
-               sptr+=1;
-               break;
-            case OP_VAL_OFF:
-               sptr+=3;
-               break;
-            case OP_WHILE_START:
-               balance++;
-               sptr+=5;
-               break;
-            case OP_WHILE_END:
-               balance--;
-               sptr+=5;
-               break;
+               if(mul_used==64)
+                  break;
+               mul_off[mul_used] = off;
+               mul_val[mul_used++] = 0;
             }
+            mul_val[e]+=code->code[m+5];
          }
 
-         *((int32_t *)&code->code[fast+1]) = sptr;
-         *((int32_t *)&code->code[sptr-4]) = fast;
-      }
+         //The loop cell is moved to the front, so that
+         //the rest of the entries are the touched cells
+         int e;
+         for(e = 0;e<mul_used&&mul_off[e]!=0;e++);
+         if(e<mul_used)
+         {
+            int32_t off = mul_off[0]; mul_off[0] = mul_off[e]; mul_off[e] = off;
+            uint8_t v = mul_val[0]; mul_val[0] = mul_val[e]; mul_val[e] = v;
+         }
 
-      switch(code->code[fast])
-      {
-      case OP_VAL_OFF:
-         fast+=3;
-         break;
-      case OP_VAL:
-      case OP_PTR:
-      case OP_GET_VAL_OFF:
-      case OP_PUT_VAL_OFF:
-      case OP_CLEAR_OFF:
-         fast+=2;
-         break;
-      case OP_GET_VAL:
-      case OP_PUT_VAL:
-      case OP_CLEAR:
-      case OP_EXIT:
-         fast+=1;
-         break;
-      case OP_WHILE_START:
-      case OP_WHILE_END:
-         fast+=5;
+         //Even steps are only accepted for plain [--] style
+         //loops, which have always been treated as clears
+         if(pos==0&&m==code->code_used&&e<mul_used&&((mul_val[0]&1)||mul_used==1))
+         {
+            //The loop disappears, the block before
+            //it continues as if it never was there
+            code->code_used = loop->block;
+            pos = loop->pos;
+            merge = loop->merge;
+
+            //Loop runs n times, with n*step+cell[0]=0 (mod 256)
+            //--> n = cell[0]*(-step^-1), the inverse of an odd number
+            //mod 2^n can be found with a few newton iterations
+            uint8_t step = mul_val[0];
+            uint8_t inv = step;
+            for(int n = 0;n<3;n++)
+               inv*=2-step*inv;
+            uint8_t factor = -inv;
+
+            for(int n = 1;n<mul_used;n++)
+            {
+               uint8_t k = mul_val[n]*factor;
+               if(k==0)
+                  continue;
+
+               bytecode_write(code,OP_MUL_ADD);
+               bytecode_write32(code,pos);
+               bytecode_write32(code,pos+mul_off[n]);
+               bytecode_write(code,k);
+               merge = code->code_used;
+            }
+            compile_val(code,merge,OP_SET,pos,0);
+            break;
+         }
+
+         //Plain loop
+         if(pos!=0)
+         {
+            bytecode_write(code,OP_PTR);
+            bytecode_write32(code,pos);
+            pos = 0;
+         }
+         bytecode_write(code,OP_WHILE_END);
+         bytecode_write32(code,body);
+         ARG32(&code->code[body-4]) = code->code_used;
+         merge = code->code_used;
          break;
       }
+      }
+   }
+
+   if(loops_used>0)
+   {
+      fprintf(stderr,"Unmatched '[' at byte %zu\n",loops[loops_used-1].source);
+      free(loops);
+      return 1;
    }
-   //-------------------------------------
+   free(loops);
+
+   if(pos!=0)
+   {
+      bytecode_write(code,OP_PTR);
+      bytecode_write32(code,pos);
+   }
+   bytecode_write(code,OP_EXIT);
+
+   return 0;
 }
 
-static void print_help(char **argv)
+//Emits an addition/set of cell off, merged into an
+//earlier one of the same cell if possible
+static void compile_val(Bytecode *code, unsigned merge, uint8_t op, int32_t off, uint8_t val)
 {
-   printf("%s usage:\n"
-          "%s -f filename [-i filename] [-dump FORMAT]\n"
-          "   -f    file to execute\n"
-          "   -i    file to read input from\n"
-          "   -dump dump bytecode in specified format (C, IR, bf)\n",
-         argv[0],argv[0]);
+   //Everything since merge is a 6 byte OP_VAL/OP_SET,
+   //only the most recent ones are checked, to keep
+   //long blocks linear
+   int found = -1;
+   for(int m = (int)code->code_used-6;m>=(int)merge&&m>=(int)code->code_used-6*16;m-=6)
+   {
+      if(ARG32(&code->code[m+1])==off)
+      {
+         found = m;
+         break;
+      }
+   }
+
+   if(found>=0&&op==OP_SET)
+   {
+      code->code[found] = OP_SET;
+      code->code[found+5] = val;
+   }
+   else if(found>=0)
+   {
+      code->code[found+5]+=val;
+   }
+   else
+   {
+      bytecode_write(code,op);
+      bytecode_write32(code,off);
+      bytecode_write(code,val);
+   }
+}
+
+//Superinstructions
+//Merges common pairs of instructions (see op_fused)
+//into a single one, to save on dispatch in the interpreter
+//None of the pairs can contain a jump target, since
+//loops are entered/repeated at their first body instruction
+static void fuse(Bytecode *code)
+{
+   //Written to a new buffer, code
+   //might be mapped from a -load-bc file
+   Bytecode fused;
+   bytecode_init(&fused);
+
+   unsigned end = code->code_used;
+   for(unsigned fast = 0;fast<end;)
+   {
+      uint8_t op = code->code[fast];
+      uint8_t next = op==OP_EXIT?OP_EXIT:code->code[fast+op_size[op]];
+      unsigned f;
+      for(f = 0;f<sizeof(op_fused)/sizeof(*op_fused);f++)
+         if(op_fused[f][0]==op&&op_fused[f][1]==next)
+            break;
+
+      if(f<sizeof(op_fused)/sizeof(*op_fused))
+      {
+         bytecode_write(&fused,OP_PTR_WHILE_START+f);
+         fast++;
+         for(int b = op_size[op]-1;b>0;b--)
+            bytecode_write(&fused,code->code[fast++]);
+         fast++;
+         for(int b = op_size[next]-1;b>0;b--)
+            bytecode_write(&fused,code->code[fast++]);
+      }
+      else
+      {
+         for(int b = op_size[op];b>0;b--)
+            bytecode_write(&fused,code->code[fast++]);
+      }
+   }
+   if(code->data_used>0)
+      bytecode_data(&fused,code->data,code->data_used);
+
+   bytecode_link(&fused);
+   bytecode_free(code);
+   *code = fused;
+}
+
+//Partial evaluation
+//Runs the program at compile time until it needs input
+//(or EVAL_STEPS instructions have been executed) and replaces
+//everything before the last instruction reached outside of any loop
+//with the output produced up to there and a snapshot of the tape
+static void partial_eval(Bytecode *code)
+{
+   //Instructions outside of loops, the
+   //only places the new program can start at
+   uint8_t *top = calloc(code->code_used,sizeof(*top));
+   int depth = 0;
+   for(unsigned i = 0;i<code->code_used;i+=op_size[code->code[i]])
+   {
+      top[i] = depth==0;
+      if(code->code[i]==OP_WHILE_START)
+         depth++;
+      else if(code->code[i]==OP_WHILE_END)
+         depth--;
+   }
+
+   Eval *eval = calloc(1,sizeof(*eval));
+   eval->pos = EVAL_TAPE/2;
+   unsigned cut = 0;
+   uint64_t cut_steps = 0;
+   partial_eval_run(code,eval,EVAL_STEPS,top,&cut,&cut_steps);
+   free(top);
+
+   if(cut_steps==0)
+   {
+      free(eval->out);
+      free(eval);
+      return;
+   }
+
+   //Second run, stops exactly at the cut
+   memset(eval->tape,0,sizeof(eval->tape));
+   eval->pos = EVAL_TAPE/2;
+   eval->out_used = 0;
+   partial_eval_run(code,eval,cut_steps,NULL,NULL,NULL);
+
+   Bytecode residual = {0};
+   bytecode_init(&residual);
+   if(eval->out_used>0)
+   {
+      bytecode_write(&residual,OP_WRITE);
+      bytecode_write32(&residual,bytecode_data(&residual,eval->out,eval->out_used));
+      bytecode_write32(&residual,eval->out_used);
+   }
+
+   //Tape contents don't matter if the program ends here
+   if(code->code[cut]!=OP_EXIT)
+   {
+      int lo = 0;
+      int hi = EVAL_TAPE;
+      while(lo<hi&&eval->tape[lo]==0)
+         lo++;
+      while(hi>lo&&eval->tape[hi-1]==0)
+         hi--;
+
+      if(hi>lo)
+      {
+         bytecode_write(&residual,OP_LOAD);
+         bytecode_write32(&residual,lo-EVAL_TAPE/2);
+         bytecode_write32(&residual,bytecode_data(&residual,eval->tape+lo,hi-lo));
+         bytecode_write32(&residual,hi-lo);
+      }
+
+      if(eval->pos!=EVAL_TAPE/2)
+      {
+         bytecode_write(&residual,OP_PTR);
+         bytecode_write32(&residual,eval->pos-EVAL_TAPE/2);
+      }
+   }
+
+   for(unsigned i = cut;i<code->code_used;i++)
+      bytecode_write(&residual,code->code[i]);
+   bytecode_link(&residual);
+
+   bytecode_free(code);
+   *code = residual;
+
+   free(eval->out);
+   free(eval);
+}
+
+//Executes up to steps instructions on the tape in eval,
+//stops before reading input or accessing cells outside of the tape
+//If top is given, cut/cut_steps receive the last instruction
+//outside of any loop that was reached and the number of instructions
+//executed before reaching it
+static void partial_eval_run(const Bytecode *code, Eval *eval, uint64_t steps, const uint8_t *top, unsigned *cut, uint64_t *cut_steps)
+{
+#define CELL_VALID(off) (eval->pos+(int64_t)(off)>=0&&eval->pos+(int64_t)(off)<EVAL_TAPE)
+#define CELL(off) (eval->tape[eval->pos+(off)])
+
+   unsigned ip = 0;
+   for(uint64_t step = 0;step<steps;step++)
+   {
+      if(top!=NULL&&top[ip])
+      {
+         *cut = ip;
+         *cut_steps = step;
+      }
+
+      const uint8_t *arg = &code->code[ip+1];
+      unsigned next = ip+op_size[code->code[ip]];
+      switch(code->code[ip])
+      {
+      case OP_PTR:
+         if(!CELL_VALID(ARG32(arg)))
+            return;
+         eval->pos+=ARG32(arg);
+         break;
+      case OP_VAL:
+         if(!CELL_VALID(ARG32(arg)))
+            return;
+         CELL(ARG32(arg))+=arg[4];
+         break;
+      case OP_SET:
+         if(!CELL_VALID(ARG32(arg)))
+            return;
+         CELL(ARG32(arg)) = arg[4];
+         break;
+      case OP_PUT_VAL:
+         if(!CELL_VALID(ARG32(arg)))
+            return;
+         if(eval->out_used==eval->out_size)
+         {
+            eval->out_size = eval->out_size*2+256;
+            eval->out = realloc(eval->out,sizeof(*eval->out)*eval->out_size);
+         }
+         eval->out[eval->out_used++] = CELL(ARG32(arg));
+         break;
+      case OP_MUL_ADD:
+         if(!CELL_VALID(ARG32(arg))||!CELL_VALID(ARG32(arg+4)))
+            return;
+         CELL(ARG32(arg+4))+=CELL(ARG32(arg))*arg[8];
+         break;
+      case OP_SCAN:
+         for(;;)
+         {
+            if(!CELL_VALID(0))
+               return;
+            if(!CELL(0))
+               break;
+            eval->pos+=ARG32(arg);
+         }
+         break;
+      case OP_WHILE_START:
+         if(!CELL_VALID(0))
+            return;
+         if(!CELL(0))
+            next = ARG32(arg);
+         break;
+      case OP_WHILE_END:
+         if(!CELL_VALID(0))
+            return;
+         if(CELL(0))
+            next = ARG32(arg);
+         break;
+      default:
+         //Input, end of program
+         return;
+      }
+
+      ip = next;
+   }
+
+#undef CELL_VALID
+#undef CELL
+}
+
+static void print_help(char **argv)
+{
+   printf("%s usage:\n"
+          "%s -f filename|-load-bc filename [-i filename] [-emit-bc filename] [-dump FORMAT] [-jit] [-aot] [-profile filename] [-fuse] [-line] [-noeval] [-time]\n"
+          "%s -batch filename [-threads N] [-jit] [-aot] [-fuse] [-noeval]\n"
+          "%s -serve socket [-cache N] [-jit] [-aot] [-fuse] [-noeval]\n"
+          "%s -connect socket -f filename [-i filename] [-line]\n"
+          "   -f       file to execute\n"
+          "   -load-bc execute bytecode file written by -emit-bc\n"
+          "   -emit-bc write optimized bytecode to file instead of running\n"
+          "   -i       file to read input from\n"
+          "   -dump    dump bytecode in specified format (C, IR, bf)\n"
+          "   -jit     compile to native code before running (x86-64 only)\n"
+          "   -aot     compile with the system C compiler, cached in ~/.cache/brainfuck\n"
+          "   -profile run with instrumentation, write annotated IR to file\n"
+          "   -fuse    use superinstructions in the interpreter\n"
+          "   -line    flush output after every newline (interactive use)\n"
+          "   -noeval  don't run the input independent prefix at compile time\n"
+          "   -time    report time spent compiling/running and peak memory use on stderr\n"
+          "   -batch   run every 'program input output' line of file, '-' for no input\n"
+          "   -threads number of worker threads for -batch (default: all cores)\n"
+          "   -serve   run programs sent to the unix socket, keeping them compiled\n"
+          "   -cache   number of programs -serve keeps compiled (default: 64)\n"
+          "   -connect run the program on the -serve server listening on socket\n",
+         argv[0],argv[0],argv[0],argv[0],argv[0]);
 }
 
 static void bytecode_init(Bytecode *code)
@@ -421,6 +1268,11 @@ static void bytecode_init(Bytecode *code)
    code->code = NULL;
    code->code_used = 0;
    code->code_size = 0;
+   code->data = NULL;
+   code->data_used = 0;
+   code->data_size = 0;
+   code->map = NULL;
+   code->map_size = 0;
 }
 
 static void bytecode_write(Bytecode *code, uint8_t byte)
@@ -441,80 +1293,270 @@ static void bytecode_write(Bytecode *code, uint8_t byte)
    }
 }
 
+static void bytecode_write32(Bytecode *code, int32_t val)
+{
+   bytecode_write(code,val&255);
+   bytecode_write(code,(val>>8)&255);
+   bytecode_write(code,(val>>16)&255);
+   bytecode_write(code,(val>>24)&255);
+}
+
+//Appends len bytes to the constant data,
+//returns their offset
+static int32_t bytecode_data(Bytecode *code, const uint8_t *data, unsigned len)
+{
+   if(code->data_used+len>code->data_size)
+   {
+      code->data_size = code->data_used+len+256;
+      code->data = realloc(code->data,sizeof(*code->data)*code->data_size);
+   }
+
+   memcpy(code->data+code->data_used,data,len);
+   code->data_used+=len;
+
+   return code->data_used-len;
+}
+
 static void bytecode_free(Bytecode *code)
 {
-   if(code->code==NULL)
+   if(code->map!=NULL)
+   {
+#if defined(__unix__)
+      munmap(code->map,code->map_size);
+#else
+      free(code->map);
+#endif
+      bytecode_init(code);
       return;
+   }
+
+   if(code->code!=NULL)
+      free(code->code);
+   if(code->data!=NULL)
+      free(code->data);
+   bytecode_init(code);
+}
+
+static int bytecode_save(const Bytecode *code, const char *path)
+{
+   FILE *out = fopen(path,"wb");
+   if(out==NULL)
+      return 1;
+
+   BytecodeHeader header = {{'B','F','B','C'},BYTECODE_VERSION,code->code_used,code->data_used};
+   int failed = fwrite(&header,sizeof(header),1,out)!=1;
+   failed|=fwrite(code->code,1,code->code_used,out)!=code->code_used;
+   failed|=fwrite(code->data,1,code->data_used,out)!=code->data_used;
+   failed|=fclose(out)!=0;
 
-   free(code->code);
+   return failed;
+}
+
+//Maps a file written by bytecode_save(),
+//code and data are used in place
+static int bytecode_load(Bytecode *code, const char *path)
+{
    bytecode_init(code);
+
+   FILE *in = fopen(path,"rb");
+   if(in==NULL)
+      return 1;
+   fseek(in,0,SEEK_END);
+   long size = ftell(in);
+   fseek(in,0,SEEK_SET);
+   if(size<(long)sizeof(BytecodeHeader))
+   {
+      fclose(in);
+      return 1;
+   }
+
+#if defined(__unix__)
+   uint8_t *map = mmap(NULL,size,PROT_READ,MAP_PRIVATE,fileno(in),0);
+   fclose(in);
+   if(map==MAP_FAILED)
+      return 1;
+#else
+   uint8_t *map = malloc(size);
+   int read = fread(map,1,size,in)==(size_t)size;
+   fclose(in);
+   if(!read)
+   {
+      free(map);
+      return 1;
+   }
+#endif
+   code->map = map;
+   code->map_size = size;
+
+   BytecodeHeader header;
+   memcpy(&header,map,sizeof(header));
+   if(memcmp(header.magic,"BFBC",4)!=0)
+   {
+      bytecode_free(code);
+      return 1;
+   }
+   if(header.version!=BYTECODE_VERSION)
+   {
+      fprintf(stderr,"%s: bytecode version %"PRIu32", expected %d\n",path,header.version,BYTECODE_VERSION);
+      bytecode_free(code);
+      return 1;
+   }
+   if(sizeof(header)+(uint64_t)header.code_used+header.data_used!=(uint64_t)size||header.code_used==0)
+   {
+      bytecode_free(code);
+      return 1;
+   }
+
+   code->code = map+sizeof(header);
+   code->code_used = header.code_used;
+   code->code_size = header.code_used;
+   code->data = map+sizeof(header)+header.code_used;
+   code->data_used = header.data_used;
+   code->data_size = header.data_used;
+
+   return 0;
+}
+
+//Stores the jump targets of all loops
+//WHILE jumps behind its ELIHW, ELIHW jumps back to the
+//first instruction of the loop body
+//The target is always the last operand of the instruction
+static void bytecode_link(Bytecode *code)
+{
+   //At most one open loop per 5 bytes of code
+   unsigned *stack = malloc(sizeof(*stack)*(code->code_used/5+1));
+   unsigned stack_used = 0;
+
+   for(unsigned fast = 0;fast<code->code_used;fast+=op_size[code->code[fast]])
+   {
+      unsigned next = fast+op_size[code->code[fast]];
+      if(code->code[fast]==OP_WHILE_START||code->code[fast]==OP_PTR_WHILE_START)
+      {
+         stack[stack_used++] = next;
+      }
+      else if(code->code[fast]==OP_WHILE_END||code->code[fast]==OP_PTR_WHILE_END)
+      {
+         unsigned body = stack[--stack_used];
+         ARG32(&code->code[body-4]) = next;
+         ARG32(&code->code[next-4]) = body;
+      }
+   }
+
+   free(stack);
 }
 
-static void bytecode_disassemble(const Bytecode *code)
+static void bytecode_disassemble(const Bytecode *code, FILE *out, const uint64_t *counts)
 {
    int end = code->code_used;
-   puts("   INDEX|        OPC|     ARG|     OFF|");
-   for(int i = 0;i<end;)
+   fprintf(out,"   INDEX|        OPC|     ARG|     OFF|     SRC|");
+   if(counts!=NULL)
+      fprintf(out,"           COUNT|");
+   fputc('\n',out);
+
+   for(int index = 0;index<end;index+=op_size[code->code[index]])
    {
-      switch(code->code[i++])
+      //Superinstructions are printed as their parts,
+      //the second part is marked with a '+'
+      uint8_t parts[2] = {code->code[index]};
+      int parts_used = 1;
+      if(code->code[index]>=OP_PTR_WHILE_START)
       {
-      case OP_PTR:
-         printf("%8d|PTR        |%8d|        |\n",i-1,(int8_t)code->code[i]); i+=1;
-         break;
-      case OP_VAL:
-         printf("%8d|VAL        |%8d|        |\n",i-1,(int8_t)code->code[i]); i+=1;
-         break;
-      case OP_VAL_OFF:
-         printf("%8d|VAL_OFF    |%8d|%8d|\n",i-1,(int8_t)code->code[i+1],(int8_t)code->code[i]); i+=2;
-         break;
-      case OP_GET_VAL:
-         printf("%8d|GET_VAL    |        |        |\n",i-1);
-         break;
-      case OP_GET_VAL_OFF:
-         printf("%8d|GET_VAL_OFF|        |%8d|\n",i-1,(int8_t)code->code[i]); i+=1;
-         break;
-      case OP_PUT_VAL:
-         printf("%8d|PUT_VAL    |        |        |\n",i-1);
-         break;
-      case OP_PUT_VAL_OFF:
-         printf("%8d|PUT_VAL_OFF|        |%8d|\n",i-1,(int8_t)code->code[i]); i+=1;
-         break;
-      case OP_CLEAR:
-         printf("%8d|CLEAR      |        |        |\n",i-1);
-         break;
-      case OP_CLEAR_OFF:
-         printf("%8d|CLEAR_OFF  |        |%8d|\n",i-1,(int8_t)code->code[i]); i+=1;
-         break;
-      case OP_WHILE_START:
-         printf("%8d|WHILE      |%8d|        |\n",i-1,*((int32_t *)&code->code[i])); i+=4;
-         break;
-      case OP_WHILE_END:
-         printf("%8d|ELIHW      |%8d|        |\n",i-1,*((int32_t *)&code->code[i])); i+=4;
-         break;
-      case OP_EXIT:
-         printf("%8d|EXIT       |        |        |\n",i-1);
-         break;
+         parts[0] = op_fused[code->code[index]-OP_PTR_WHILE_START][0];
+         parts[1] = op_fused[code->code[index]-OP_PTR_WHILE_START][1];
+         parts_used = 2;
+      }
+
+      const uint8_t *arg = &code->code[index+1];
+      for(int p = 0;p<parts_used;p++)
+      {
+         if(p==0)
+            fprintf(out,"%8d|",index);
+         else
+            fprintf(out,"       +|");
+
+         switch(parts[p])
+         {
+         case OP_PTR:
+            fprintf(out,"PTR        |%8d|        |        |",ARG32(arg));
+            break;
+         case OP_VAL:
+            fprintf(out,"VAL        |%8d|%8d|        |",(int8_t)arg[4],ARG32(arg));
+            break;
+         case OP_SET:
+            fprintf(out,"SET        |%8d|%8d|        |",arg[4],ARG32(arg));
+            break;
+         case OP_GET_VAL:
+            fprintf(out,"GET_VAL    |        |%8d|        |",ARG32(arg));
+            break;
+         case OP_PUT_VAL:
+            fprintf(out,"PUT_VAL    |        |%8d|        |",ARG32(arg));
+            break;
+         case OP_MUL_ADD:
+            fprintf(out,"MUL_ADD    |%8d|%8d|%8d|",(int8_t)arg[8],ARG32(arg+4),ARG32(arg));
+            break;
+         case OP_SCAN:
+            fprintf(out,"SCAN       |%8d|        |        |",ARG32(arg));
+            break;
+         case OP_WHILE_START:
+            fprintf(out,"WHILE      |%8d|        |        |",ARG32(arg));
+            break;
+         case OP_WHILE_END:
+            fprintf(out,"ELIHW      |%8d|        |        |",ARG32(arg));
+            break;
+         case OP_EXIT:
+            fprintf(out,"EXIT       |        |        |        |");
+            break;
+         case OP_WRITE:
+            fprintf(out,"WRITE      |%8d|        |%8d|",ARG32(arg+4),ARG32(arg));
+            break;
+         case OP_LOAD:
+            fprintf(out,"LOAD       |%8d|%8d|%8d|",ARG32(arg+8),ARG32(arg),ARG32(arg+4));
+            break;
+         }
+         arg+=op_size[parts[p]]-1;
+
+         //Profiling data: execution count of each instruction,
+         //loops are annotated with their iteration count,
+         //WHILE gets executed once per entry, ELIHW once per iteration
+         if(counts!=NULL&&p==0)
+         {
+            fprintf(out,"%16"PRIu64"|",counts[index]);
+            if(code->code[index]==OP_WHILE_START&&counts[index]>0)
+            {
+               uint64_t iterations = counts[ARG32(&code->code[index+1])-5];
+               fprintf(out," %"PRIu64" entries, %.1f iterations/entry",counts[index],(double)iterations/(double)counts[index]);
+            }
+         }
+         fputc('\n',out);
       }
    }
 }
 
-static void bytecode_run(const Bytecode *code, FILE *input)
+static void bytecode_run(const Bytecode *code, Vm *vm)
 {
+   uint8_t *ptr = vm->ptr;
+   Io *io = &vm->io;
+
 #if COMPUTED_GOTO
    const void *dispatch_table[] =
    {
       &&case_OP_PTR,
       &&case_OP_VAL,
-      &&case_OP_VAL_OFF,
+      &&case_OP_SET,
       &&case_OP_GET_VAL,
-      &&case_OP_GET_VAL_OFF,
       &&case_OP_PUT_VAL,
-      &&case_OP_PUT_VAL_OFF,
-      &&case_OP_CLEAR,
-      &&case_OP_CLEAR_OFF,
+      &&case_OP_MUL_ADD,
+      &&case_OP_SCAN,
       &&case_OP_WHILE_START,
       &&case_OP_WHILE_END,
       &&case_OP_EXIT,
+      &&case_OP_WRITE,
+      &&case_OP_LOAD,
+      &&case_OP_PTR_WHILE_START,
+      &&case_OP_PTR_WHILE_END,
+      &&case_OP_SET_PTR,
+      &&case_OP_VAL_PTR,
+      &&case_OP_MUL_ADD_SET,
    };
 
 #define DISPATCH() goto *dispatch_table[*ip++]
@@ -535,153 +1577,1886 @@ static void bytecode_run(const Bytecode *code, FILE *input)
 #endif
       switch(*ip++)
       {
-      case_OP_PTR: ptr+=(int8_t)(*ip++); DISPATCH();
+      case_OP_PTR: ptr+=ARG32(ip); ip+=4; DISPATCH();
 
-      case_OP_VAL: *ptr+=(int8_t)(*ip++); DISPATCH();
-      case_OP_VAL_OFF: *(ptr+(int8_t)(*ip))+=(int8_t)*(ip+1); ip+=2; DISPATCH();
+      case_OP_VAL: *(ptr+ARG32(ip))+=*(ip+4); ip+=5; DISPATCH();
+      case_OP_SET: *(ptr+ARG32(ip)) = *(ip+4); ip+=5; DISPATCH();
 
-      case_OP_GET_VAL: *ptr = fgetc(input); DISPATCH();
-      case_OP_GET_VAL_OFF: *(ptr+(int8_t)(*ip++)) = fgetc(input); DISPATCH();
+      case_OP_GET_VAL: *(ptr+ARG32(ip)) = io_get(io); ip+=4; DISPATCH();
+      case_OP_PUT_VAL: io_put(io,*(ptr+ARG32(ip))); ip+=4; DISPATCH();
 
-      case_OP_PUT_VAL: putchar(*ptr); fflush(stdout); DISPATCH();
-      case_OP_PUT_VAL_OFF: putchar(*(ptr+(int8_t)(*ip++))); fflush(stdout); DISPATCH();
+      case_OP_MUL_ADD: *(ptr+ARG32(ip+4))+=*(ptr+ARG32(ip))*(*(ip+8)); ip+=9; DISPATCH();
 
-      case_OP_CLEAR: *ptr = 0; DISPATCH();
-      case_OP_CLEAR_OFF: *(ptr+(int8_t)(*ip++)) = 0; DISPATCH();
+      case_OP_SCAN: ptr = scan(vm,ptr,ARG32(ip)); ip+=4; DISPATCH();
 
       case_OP_WHILE_START: 
          if(!(*ptr))
-            ip = code->code+(*((int32_t *)ip));
+            ip = code->code+ARG32(ip);
          else
             ip+=4;
          DISPATCH();
-      case_OP_WHILE_END: ip = code->code+(*((int32_t *)ip)); DISPATCH();
+      case_OP_WHILE_END: 
+         if(*ptr)
+            ip = code->code+ARG32(ip);
+         else
+            ip+=4;
+         DISPATCH();
+
+      case_OP_EXIT: vm->ptr = ptr; return;
 
-      case_OP_EXIT: return;
+      case_OP_WRITE: io_write(io,code->data+ARG32(ip),ARG32(ip+4)); ip+=8; DISPATCH();
+      case_OP_LOAD: memcpy(ptr+ARG32(ip),code->data+ARG32(ip+4),ARG32(ip+8)); ip+=12; DISPATCH();
+
+      case_OP_PTR_WHILE_START:
+         ptr+=ARG32(ip);
+         if(!(*ptr))
+            ip = code->code+ARG32(ip+4);
+         else
+            ip+=8;
+         DISPATCH();
+      case_OP_PTR_WHILE_END:
+         ptr+=ARG32(ip);
+         if(*ptr)
+            ip = code->code+ARG32(ip+4);
+         else
+            ip+=8;
+         DISPATCH();
+      case_OP_SET_PTR: *(ptr+ARG32(ip)) = *(ip+4); ptr+=ARG32(ip+5); ip+=9; DISPATCH();
+      case_OP_VAL_PTR: *(ptr+ARG32(ip))+=*(ip+4); ptr+=ARG32(ip+5); ip+=9; DISPATCH();
+      case_OP_MUL_ADD_SET: *(ptr+ARG32(ip+4))+=*(ptr+ARG32(ip))*(*(ip+8)); *(ptr+ARG32(ip+9)) = *(ip+13); ip+=14; DISPATCH();
       }
    }
 
 #undef DISPATCH
 }
 
-static void dump_bf(const Bytecode *code)
+//Instrumented interpreter for -profile
+//Counts how often each instruction and each pair/triple of
+//consecutive opcodes gets executed and writes the
+//annotated IR to report
+static void bytecode_profile(const Bytecode *code, Vm *vm, FILE *report)
 {
-   int end = code->code_used;
-   for(int i = 0;i<end;)
+   uint8_t *ptr = vm->ptr;
+   Io *io = &vm->io;
+   uint64_t *counts = calloc(code->code_used,sizeof(*counts));
+   uint64_t pairs[OP_COUNT][OP_COUNT] = {0};
+   uint64_t triples[OP_COUNT][OP_COUNT][OP_COUNT] = {0};
+   int prev = -1;
+   int prev2 = -1;
+
+   uint8_t *ip = code->code;
+   for(;;)
    {
-      switch(code->code[i++])
+      uint8_t op = *ip;
+      counts[ip-code->code]++;
+      if(prev>=0)
+         pairs[prev][op]++;
+      if(prev2>=0)
+         triples[prev2][prev][op]++;
+      prev2 = prev;
+      prev = op;
+
+      ip++;
+      switch(op)
       {
-      case OP_PTR:
-         for(int j = 0;j<ABS((int8_t)code->code[i]);j++)
-            fputc((int8_t)code->code[i]<0?'<':'>',stdout);
-         i++;
-         break;
-      case OP_VAL:
-         for(int j = 0;j<ABS((int8_t)code->code[i]);j++)
-            fputc((int8_t)code->code[i]<0?'-':'+',stdout);
-         i++;
+      case OP_PTR: ptr+=ARG32(ip); ip+=4; break;
+      case OP_VAL: *(ptr+ARG32(ip))+=*(ip+4); ip+=5; break;
+      case OP_SET: *(ptr+ARG32(ip)) = *(ip+4); ip+=5; break;
+      case OP_GET_VAL: *(ptr+ARG32(ip)) = io_get(io); ip+=4; break;
+      case OP_PUT_VAL: io_put(io,*(ptr+ARG32(ip))); ip+=4; break;
+      case OP_MUL_ADD: *(ptr+ARG32(ip+4))+=*(ptr+ARG32(ip))*(*(ip+8)); ip+=9; break;
+      case OP_SCAN: ptr = scan(vm,ptr,ARG32(ip)); ip+=4; break;
+      case OP_WHILE_START: ip = (*ptr)?ip+4:code->code+ARG32(ip); break;
+      case OP_WHILE_END: ip = (*ptr)?code->code+ARG32(ip):ip+4; break;
+      case OP_WRITE: io_write(io,code->data+ARG32(ip),ARG32(ip+4)); ip+=8; break;
+      case OP_LOAD: memcpy(ptr+ARG32(ip),code->data+ARG32(ip+4),ARG32(ip+8)); ip+=12; break;
+      }
+
+      if(op==OP_EXIT)
          break;
-      case OP_VAL_OFF:
-         for(int j = 0;j<ABS((int8_t)code->code[i]);j++)
-            fputc((int8_t)code->code[i]<0?'<':'>',stdout);
+   }
+   vm->ptr = ptr;
 
-         for(int j = 0;j<ABS((int8_t)code->code[i+1]);j++)
-            fputc((int8_t)code->code[i+1]<0?'-':'+',stdout);
+   bytecode_disassemble(code,report,counts);
 
-         for(int j = 0;j<ABS((int8_t)code->code[i]);j++)
-            fputc((int8_t)code->code[i]<0?'>':'<',stdout);
+   uint64_t total = 0;
+   for(unsigned i = 0;i<code->code_used;i++)
+      total+=counts[i];
+   fprintf(report,"\n           COUNT|TOTAL\n%16"PRIu64"|\n",total);
 
-         i+=2;
-         break;
-      case OP_GET_VAL:
-         fputc(',',stdout);
-         break;
-      case OP_GET_VAL_OFF:
-         for(int j = 0;j<ABS((int8_t)code->code[i]);j++)
-            fputc((int8_t)code->code[i]<0?'<':'>',stdout);
+   //Most common sequences, these are
+   //candidates for superinstructions (see -fuse)
+   uint64_t *seq = malloc(sizeof(*seq)*OP_COUNT*OP_COUNT*OP_COUNT*2);
+   int seq_used = 0;
+   for(int len = 2;len<=3;len++)
+   {
+      seq_used = 0;
+      for(unsigned a = 0;a<OP_COUNT;a++)
+      {
+         for(unsigned b = 0;b<OP_COUNT;b++)
+         {
+            for(unsigned c = 0;c<(len==3?OP_COUNT:1);c++)
+            {
+               uint64_t count = len==3?triples[a][b][c]:pairs[a][b];
+               if(count==0)
+                  continue;
+               seq[seq_used*2] = count;
+               seq[seq_used*2+1] = (a*OP_COUNT+b)*OP_COUNT+c;
+               seq_used++;
+            }
+         }
+      }
+      qsort(seq,seq_used,sizeof(*seq)*2,profile_cmp);
 
-         fputc(',',stdout);
+      fprintf(report,"\n           COUNT|%s\n",len==3?"TRIPLE":"PAIR");
+      for(int i = 0;i<seq_used&&i<16;i++)
+      {
+         unsigned a = seq[i*2+1]/(OP_COUNT*OP_COUNT);
+         unsigned b = (seq[i*2+1]/OP_COUNT)%OP_COUNT;
+         unsigned c = seq[i*2+1]%OP_COUNT;
+         fprintf(report,"%16"PRIu64"|%-11s %-11s",seq[i*2],op_name[a],op_name[b]);
+         if(len==3)
+            fprintf(report," %-11s",op_name[c]);
+         fputc('\n',report);
+      }
+   }
 
-         for(int j = 0;j<ABS((int8_t)code->code[i]);j++)
-            fputc((int8_t)code->code[i]<0?'>':'<',stdout);
-         i++;
-         break;
-      case OP_PUT_VAL:
-         fputc('.',stdout);
-         break;
-      case OP_PUT_VAL_OFF:
-         for(int j = 0;j<ABS((int8_t)code->code[i]);j++)
-            fputc((int8_t)code->code[i]<0?'<':'>',stdout);
+   free(seq);
+   free(counts);
+}
 
-         fputc('.',stdout);
+//Sorts (count,sequence) pairs by count, descending
+static int profile_cmp(const void *a, const void *b)
+{
+   uint64_t ca = ((const uint64_t *)a)[0];
+   uint64_t cb = ((const uint64_t *)b)[0];
+   if(ca==cb)
+      return 0;
+   return ca<cb?1:-1;
+}
 
-         for(int j = 0;j<ABS((int8_t)code->code[i]);j++)
-            fputc((int8_t)code->code[i]<0?'>':'<',stdout);
+//Moves ptr by stride until it points to a zero cell
+static uint8_t *scan(const Vm *vm, uint8_t *ptr, int stride)
+{
+   uint8_t *tape_start = vm->tape_start;
+   uint8_t *tape_end = vm->tape_end;
 
-         i++;
-         break;
-      case OP_CLEAR:
-         fputc('[',stdout);
-         fputc('-',stdout);
-         fputc(']',stdout);
-         break;
-      case OP_CLEAR_OFF:
-         for(int j = 0;j<ABS((int8_t)code->code[i]);j++)
-            fputc((int8_t)code->code[i]<0?'<':'>',stdout);
+   if(stride==1)
+   {
+      uint8_t *found = memchr(ptr,0,tape_end-ptr);
+      if(found!=NULL)
+         return found;
+      ptr = tape_end;
+   }
+#if defined(__GLIBC__)
+   else if(stride==-1)
+   {
+      uint8_t *found = memrchr(tape_start,0,ptr-tape_start+1);
+      if(found!=NULL)
+         return found;
+      ptr = tape_start-1;
+   }
+#endif
+#if defined(__SSE2__)
+   //Small strides: compare 16 cells at once and
+   //mask out the ones that aren't visited
+   else if(stride>1&&stride<16)
+   {
+      int visited = 0;
+      for(int i = 0;i<16;i+=stride)
+         visited|=1<<i;
+      int advance = (15/stride+1)*stride;
 
-         fputc('[',stdout);
-         fputc('-',stdout);
-         fputc(']',stdout);
+      for(;ptr+16<=tape_end;ptr+=advance)
+      {
+         int zero = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)ptr),_mm_setzero_si128()))&visited;
+         if(zero)
+            return ptr+__builtin_ctz(zero);
+      }
+   }
+   else if(stride<-1&&stride>-16)
+   {
+      int visited = 0;
+      for(int i = 15;i>=0;i+=stride)
+         visited|=1<<i;
+      int advance = (15/-stride+1)*-stride;
+
+      for(;ptr-15>=tape_start;ptr-=advance)
+      {
+         int zero = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(ptr-15)),_mm_setzero_si128()))&visited;
+         if(zero)
+            return ptr-15+(31-__builtin_clz(zero));
+      }
+   }
+#endif
+
+   //Remaining cells (or large strides)
+   while(*ptr)
+      ptr+=stride;
+
+   return ptr;
+}
+
+static void dump_bf(const Bytecode *code)
+{
+   //Position relative to the start of the current block,
+   //instructions are emitted in order, moving the pointer
+   //as needed
+   int32_t pos = 0;
+
+   //Multiplication loops are stored as a series of
+   //OP_MUL_ADD terminated by OP_SET of the loop cell
+   int mul = 0;
+
+   int end = code->code_used;
+   for(int i = 0;i<end;)
+   {
+      switch(code->code[i++])
+      {
+      case OP_PTR:
+         dump_bf_move(&pos,ARG32(&code->code[i]));
+         pos = 0;
+         i+=4;
+         break;
+      case OP_VAL:
+         dump_bf_move(&pos,ARG32(&code->code[i]));
+         for(int j = 0;j<ABS((int8_t)code->code[i+4]);j++)
+            fputc((int8_t)code->code[i+4]<0?'-':'+',stdout);
+         i+=5;
+         break;
+      case OP_SET:
+         dump_bf_move(&pos,ARG32(&code->code[i]));
+         if(!mul)
+         {
+            fputc('[',stdout);
+            fputc('-',stdout);
+         }
+         fputc(']',stdout);
+         mul = 0;
+
+         for(int j = 0;j<ABS((int8_t)code->code[i+4]);j++)
+            fputc((int8_t)code->code[i+4]<0?'-':'+',stdout);
+         i+=5;
+         break;
+      case OP_GET_VAL:
+         dump_bf_move(&pos,ARG32(&code->code[i]));
+         fputc(',',stdout);
+         i+=4;
+         break;
+      case OP_PUT_VAL:
+         dump_bf_move(&pos,ARG32(&code->code[i]));
+         fputc('.',stdout);
+         i+=4;
+         break;
+      case OP_MUL_ADD:
+         if(!mul)
+         {
+            dump_bf_move(&pos,ARG32(&code->code[i]));
+            fputc('[',stdout);
+            fputc('-',stdout);
+            mul = 1;
+         }
 
-         for(int j = 0;j<ABS((int8_t)code->code[i]);j++)
-            fputc((int8_t)code->code[i]<0?'>':'<',stdout);
-         i++;
+         dump_bf_move(&pos,ARG32(&code->code[i+4]));
+         for(int j = 0;j<ABS((int8_t)code->code[i+8]);j++)
+            fputc((int8_t)code->code[i+8]<0?'-':'+',stdout);
+         i+=9;
+         break;
+      case OP_SCAN:
+         dump_bf_move(&pos,0);
+         fputc('[',stdout);
+         for(int j = 0;j<ABS(ARG32(&code->code[i]));j++)
+            fputc(ARG32(&code->code[i])<0?'<':'>',stdout);
+         fputc(']',stdout);
+         i+=4;
          break;
       case OP_WHILE_START:
+         dump_bf_move(&pos,0);
          fputc('[',stdout);
          i+=4;
          break;
       case OP_WHILE_END:
+         dump_bf_move(&pos,0);
          fputc(']',stdout);
          i+=4;
          break;
+      case OP_WRITE:
+      case OP_LOAD:
+         fprintf(stderr,"Partially evaluated bytecode can't be converted to bf (see -noeval)\n");
+         return;
       }
    }
 }
 
-static void dump_c(const Bytecode *code)
+static void dump_bf_move(int32_t *pos, int32_t to)
+{
+   for(;*pos<to;(*pos)++)
+      fputc('>',stdout);
+   for(;*pos>to;(*pos)--)
+      fputc('<',stdout);
+}
+
+//aot: emit a function for aot_compile() instead of a standalone program
+//uint8_t *bf_run(uint8_t *ptr, void *io, int (*get)(void *io), void (*put)(void *io, int c))
+static void dump_c(const Bytecode *code, FILE *out, int aot)
 {
 #define PRINT_INDENT(a) \
-   for(int print_indent_o = 0;print_indent_o<(a);print_indent_o++) printf("   ");
+   for(int print_indent_o = 0;print_indent_o<(a);print_indent_o++) fprintf(out,"   ");
 
-   printf("#include <stdio.h>\n#include <stdint.h>\n\nuint8_t mem[%d];\nuint8_t *ptr = mem;\n\nint main(int argc, char **argv)\n{\n   FILE *in = stdin;\n   if(argc>1)\n      in = fopen(argv[1],\"r\");\n\n",MEM_SIZE);
+   if(aot)
+      fprintf(out,"#include <stdint.h>\n#include <string.h>\n\nuint8_t *bf_run(uint8_t *ptr, void *io, int (*get)(void *io), void (*put)(void *io, int c))\n{\n");
+   else
+      fprintf(out,"#include <stdio.h>\n#include <stdint.h>\n#include <string.h>\n\nuint8_t mem[%d];\nuint8_t *ptr = mem;\n\nint main(int argc, char **argv)\n{\n   FILE *in = stdin;\n   if(argc>1)\n      in = fopen(argv[1],\"r\");\n\n",MEM_SIZE);
    int indent = 1;
    int end = code->code_used;
    for(int i = 0;i<end;)
    {
       switch(code->code[i++])
       {
-      case OP_PTR: PRINT_INDENT(indent); printf("ptr+=%d;\n",(int8_t)code->code[i]); i++; break;
-      case OP_VAL: PRINT_INDENT(indent); printf("*ptr+=%d;\n",(int8_t)code->code[i]); i++; break;
-      case OP_VAL_OFF: PRINT_INDENT(indent); printf("*(ptr+%d)+=%d;\n",(int8_t)code->code[i],(int8_t)code->code[i+1]); i+=2; break;
-      case OP_GET_VAL: PRINT_INDENT(indent); printf("*ptr = fgetc(in);\n"); break;
-      case OP_GET_VAL_OFF: PRINT_INDENT(indent); printf("*(ptr+%d) = fgetc(in);\n",(int8_t)code->code[i]); i++; break;
-      case OP_PUT_VAL: PRINT_INDENT(indent); printf("putchar(*ptr);\n"); break;
-      case OP_PUT_VAL_OFF: PRINT_INDENT(indent); printf("putchar(*(ptr+%d));\n",(int8_t)code->code[i]); i++; break;
-      case OP_CLEAR: PRINT_INDENT(indent); printf("*ptr = 0;\n"); break;
-      case OP_CLEAR_OFF: PRINT_INDENT(indent); printf("*(ptr+%d) = 0;\n",(int8_t)code->code[i]); i++; break;
-      case OP_WHILE_START: PRINT_INDENT(indent); printf("while(*ptr)\n"); PRINT_INDENT(indent); printf("{\n"); indent++; i+=4; break;
-      case OP_WHILE_END: indent--; PRINT_INDENT(indent); printf("}\n"); i+=4; break;
+      case OP_PTR: PRINT_INDENT(indent); fprintf(out,"ptr+=%d;\n",ARG32(&code->code[i])); i+=4; break;
+      case OP_VAL: PRINT_INDENT(indent); fprintf(out,"*(ptr+%d)+=%d;\n",ARG32(&code->code[i]),(int8_t)code->code[i+4]); i+=5; break;
+      case OP_SET: PRINT_INDENT(indent); fprintf(out,"*(ptr+%d) = %d;\n",ARG32(&code->code[i]),code->code[i+4]); i+=5; break;
+      case OP_GET_VAL: PRINT_INDENT(indent); fprintf(out,aot?"*(ptr+%d) = get(io);\n":"*(ptr+%d) = fgetc(in);\n",ARG32(&code->code[i])); i+=4; break;
+      case OP_PUT_VAL: PRINT_INDENT(indent); fprintf(out,aot?"put(io,*(ptr+%d));\n":"putchar(*(ptr+%d));\n",ARG32(&code->code[i])); i+=4; break;
+      case OP_MUL_ADD: PRINT_INDENT(indent); fprintf(out,"*(ptr+%d)+=*(ptr+%d)*%d;\n",ARG32(&code->code[i+4]),ARG32(&code->code[i]),code->code[i+8]); i+=9; break;
+      case OP_SCAN: PRINT_INDENT(indent); fprintf(out,"while(*ptr) ptr+=%d;\n",ARG32(&code->code[i])); i+=4; break;
+      case OP_WHILE_START: PRINT_INDENT(indent); fprintf(out,"while(*ptr)\n"); PRINT_INDENT(indent); fprintf(out,"{\n"); indent++; i+=4; break;
+      case OP_WHILE_END: indent--; PRINT_INDENT(indent); fprintf(out,"}\n"); i+=4; break;
       case OP_EXIT: break;
+      case OP_WRITE:
+      case OP_LOAD:
+      {
+         int is_write = code->code[i-1]==OP_WRITE;
+         const uint8_t *data = code->data+ARG32(&code->code[is_write?i:i+4]);
+         int len = ARG32(&code->code[is_write?i+4:i+8]);
+         PRINT_INDENT(indent); fprintf(out,"{\n");
+         PRINT_INDENT(indent+1); fprintf(out,"static const uint8_t data[%d] =\n",len);
+         PRINT_INDENT(indent+1); fprintf(out,"{");
+         for(int d = 0;d<len;d++)
+         {
+            if(d%32==0)
+            {
+               fprintf(out,"\n");
+               PRINT_INDENT(indent+2);
+            }
+            fprintf(out,"%d,",data[d]);
+         }
+         fprintf(out,"\n");
+         PRINT_INDENT(indent+1); fprintf(out,"};\n");
+         PRINT_INDENT(indent+1);
+         if(!is_write)
+            fprintf(out,"memcpy(ptr+%d,data,%d);\n",ARG32(&code->code[i]),len);
+         else if(aot)
+            fprintf(out,"for(int i = 0;i<%d;i++) put(io,data[i]);\n",len);
+         else
+            fprintf(out,"fwrite(data,1,%d,stdout);\n",len);
+         PRINT_INDENT(indent); fprintf(out,"}\n");
+         i+=op_size[code->code[i-1]]-1;
+         break;
+      }
       }
    }
-   printf("\n   if(argc>1)\n      fclose(in);\n\n   return 0;\n}");
+   if(aot)
+      fprintf(out,"\n   return ptr;\n}\n");
+   else
+      fprintf(out,"\n   if(argc>1)\n      fclose(in);\n\n   return 0;\n}");
 
 #undef PRINT_INDENT
 }
 
+#if JIT
+
+//x86-64 code generation
+//Register usage:
+//rbx --> ptr
+//r12 --> vm
+//Both are callee-saved, so they survive
+//the calls to jit_get()/jit_put()
+
+static void jit_write(Jit *jit, uint8_t byte)
+{
+   if(jit->code==NULL)
+   {
+      jit->code_used = 0;
+      jit->code_size = 256;
+      jit->code = malloc(sizeof(*jit->code)*jit->code_size);
+   }
+
+   jit->code[jit->code_used++] = byte;
+
+   if(jit->code_used>=jit->code_size)
+   {
+      jit->code_size+=256;
+      jit->code = realloc(jit->code,sizeof(*jit->code)*jit->code_size);
+   }
+}
+
+static void jit_write32(Jit *jit, int32_t val)
+{
+   jit_write(jit,val&255);
+   jit_write(jit,(val>>8)&255);
+   jit_write(jit,(val>>16)&255);
+   jit_write(jit,(val>>24)&255);
+}
+
+static void jit_write64(Jit *jit, uint64_t val)
+{
+   jit_write32(jit,(int32_t)(val&UINT32_MAX));
+   jit_write32(jit,(int32_t)(val>>32));
+}
+
+static int jit_get(Vm *vm)
+{
+   return io_get(&vm->io);
+}
+
+static void jit_put(Vm *vm, int c)
+{
+   io_put(&vm->io,c);
+}
+
+static void jit_literal(Vm *vm, const uint8_t *data, unsigned len)
+{
+   io_write(&vm->io,data,len);
+}
+
+//add byte [rbx+off], val
+static void jit_emit_add(Jit *jit, int32_t off, int8_t val)
+{
+   jit_write(jit,0x80); jit_write(jit,0x83); jit_write32(jit,off); jit_write(jit,val);
+}
+
+//mov byte [rbx+off], val
+static void jit_emit_set(Jit *jit, int32_t off, uint8_t val)
+{
+   jit_write(jit,0xc6); jit_write(jit,0x83); jit_write32(jit,off); jit_write(jit,val);
+}
+
+//mov rdi, r12
+//call jit_get
+//mov byte [rbx+off], al
+static void jit_emit_get(Jit *jit, int32_t off)
+{
+   jit_write(jit,0x4c); jit_write(jit,0x89); jit_write(jit,0xe7);
+   jit_write(jit,0x48); jit_write(jit,0xb8); jit_write64(jit,(uint64_t)(uintptr_t)jit_get);
+   jit_write(jit,0xff); jit_write(jit,0xd0);
+   jit_write(jit,0x88); jit_write(jit,0x83); jit_write32(jit,off);
+}
+
+//mov rdi, r12
+//movzx esi, byte [rbx+off]
+//call jit_put
+static void jit_emit_put(Jit *jit, int32_t off)
+{
+   jit_write(jit,0x4c); jit_write(jit,0x89); jit_write(jit,0xe7);
+   jit_write(jit,0x0f); jit_write(jit,0xb6); jit_write(jit,0xb3); jit_write32(jit,off);
+   jit_write(jit,0x48); jit_write(jit,0xb8); jit_write64(jit,(uint64_t)(uintptr_t)jit_put);
+   jit_write(jit,0xff); jit_write(jit,0xd0);
+}
+
+static int jit_compile(const Bytecode *code, Jit *jit)
+{
+   //Native code offset of every bytecode instruction,
+   //needed for resolving the jump targets from pass 4
+   unsigned *native = malloc(sizeof(*native)*(code->code_used+1));
+   //Location of the rel32 operand of each forward jump
+   //and the bytecode offset it targets
+   unsigned *fixup = malloc(sizeof(*fixup)*(code->code_used+1)*2);
+   int fixup_used = 0;
+
+   //Prologue
+   //push rbx; push r12; push r13 (keeps the stack 16 byte aligned)
+   //mov rbx, rdi
+   //mov r12, rsi
+   jit_write(jit,0x53); jit_write(jit,0x41); jit_write(jit,0x54); jit_write(jit,0x41); jit_write(jit,0x55);
+   jit_write(jit,0x48); jit_write(jit,0x89); jit_write(jit,0xfb);
+   jit_write(jit,0x49); jit_write(jit,0x89); jit_write(jit,0xf4);
+
+   int end = code->code_used;
+   for(int i = 0;i<end;)
+   {
+      native[i] = jit->code_used;
+
+      switch(code->code[i++])
+      {
+      case OP_PTR:
+         //add rbx, imm32
+         jit_write(jit,0x48); jit_write(jit,0x81); jit_write(jit,0xc3); jit_write32(jit,ARG32(&code->code[i]));
+         i+=4;
+         break;
+      case OP_VAL:
+         jit_emit_add(jit,ARG32(&code->code[i]),code->code[i+4]);
+         i+=5;
+         break;
+      case OP_SET:
+         jit_emit_set(jit,ARG32(&code->code[i]),code->code[i+4]);
+         i+=5;
+         break;
+      case OP_GET_VAL:
+         jit_emit_get(jit,ARG32(&code->code[i]));
+         i+=4;
+         break;
+      case OP_PUT_VAL:
+         jit_emit_put(jit,ARG32(&code->code[i]));
+         i+=4;
+         break;
+      case OP_MUL_ADD:
+         //movzx eax, byte [rbx+off]
+         //imul eax, eax, k
+         //add byte [rbx+dst], al
+         jit_write(jit,0x0f); jit_write(jit,0xb6); jit_write(jit,0x83); jit_write32(jit,ARG32(&code->code[i]));
+         if(code->code[i+8]!=1)
+         {
+            jit_write(jit,0x69); jit_write(jit,0xc0); jit_write32(jit,code->code[i+8]);
+         }
+         jit_write(jit,0x00); jit_write(jit,0x83); jit_write32(jit,ARG32(&code->code[i+4]));
+         i+=9;
+         break;
+      case OP_SCAN:
+         //mov rdi, r12
+         //mov rsi, rbx
+         //mov edx, stride
+         //call scan
+         //mov rbx, rax
+         jit_write(jit,0x4c); jit_write(jit,0x89); jit_write(jit,0xe7);
+         jit_write(jit,0x48); jit_write(jit,0x89); jit_write(jit,0xde);
+         jit_write(jit,0xba); jit_write32(jit,ARG32(&code->code[i]));
+         jit_write(jit,0x48); jit_write(jit,0xb8); jit_write64(jit,(uint64_t)(uintptr_t)scan);
+         jit_write(jit,0xff); jit_write(jit,0xd0);
+         jit_write(jit,0x48); jit_write(jit,0x89); jit_write(jit,0xc3);
+         i+=4;
+         break;
+      case OP_WHILE_START:
+         //cmp byte [rbx], 0
+         //je <after matching ELIHW>
+         jit_write(jit,0x80); jit_write(jit,0x3b); jit_write(jit,0);
+         jit_write(jit,0x0f); jit_write(jit,0x84);
+         fixup[fixup_used*2] = jit->code_used;
+         fixup[fixup_used*2+1] = ARG32(&code->code[i]);
+         fixup_used++;
+         jit_write32(jit,0);
+         i+=4;
+         break;
+      case OP_WHILE_END:
+         //cmp byte [rbx], 0
+         //jne <after matching WHILE>
+         //The target is always behind us, so it can be resolved right away
+         jit_write(jit,0x80); jit_write(jit,0x3b); jit_write(jit,0);
+         jit_write(jit,0x0f); jit_write(jit,0x85);
+         jit_write32(jit,native[ARG32(&code->code[i])]-(jit->code_used+4));
+         i+=4;
+         break;
+      case OP_WRITE:
+         //mov rdi, r12
+         //mov rsi, data
+         //mov edx, len
+         //call jit_literal
+         jit_write(jit,0x4c); jit_write(jit,0x89); jit_write(jit,0xe7);
+         jit_write(jit,0x48); jit_write(jit,0xbe); jit_write64(jit,(uint64_t)(uintptr_t)(code->data+ARG32(&code->code[i])));
+         jit_write(jit,0xba); jit_write32(jit,ARG32(&code->code[i+4]));
+         jit_write(jit,0x48); jit_write(jit,0xb8); jit_write64(jit,(uint64_t)(uintptr_t)jit_literal);
+         jit_write(jit,0xff); jit_write(jit,0xd0);
+         i+=8;
+         break;
+      case OP_LOAD:
+         //lea rdi, [rbx+off]
+         //mov rsi, data
+         //mov edx, len
+         //call memcpy
+         jit_write(jit,0x48); jit_write(jit,0x8d); jit_write(jit,0xbb); jit_write32(jit,ARG32(&code->code[i]));
+         jit_write(jit,0x48); jit_write(jit,0xbe); jit_write64(jit,(uint64_t)(uintptr_t)(code->data+ARG32(&code->code[i+4])));
+         jit_write(jit,0xba); jit_write32(jit,ARG32(&code->code[i+8]));
+         jit_write(jit,0x48); jit_write(jit,0xb8); jit_write64(jit,(uint64_t)(uintptr_t)memcpy);
+         jit_write(jit,0xff); jit_write(jit,0xd0);
+         i+=12;
+         break;
+      case OP_EXIT:
+         //Epilogue
+         //mov rax, rbx
+         //pop r13; pop r12; pop rbx
+         //ret
+         jit_write(jit,0x48); jit_write(jit,0x89); jit_write(jit,0xd8);
+         jit_write(jit,0x41); jit_write(jit,0x5d); jit_write(jit,0x41); jit_write(jit,0x5c); jit_write(jit,0x5b);
+         jit_write(jit,0xc3);
+         break;
+      }
+   }
+   native[end] = jit->code_used;
+
+   for(int i = 0;i<fixup_used;i++)
+   {
+      int32_t rel = native[fixup[i*2+1]]-(fixup[i*2]+4);
+      memcpy(&jit->code[fixup[i*2]],&rel,sizeof(rel));
+   }
+
+   free(native);
+   free(fixup);
+
+   //Copy to executable memory
+   //Mapped writable first and made executable afterwards,
+   //some systems refuse W+X mappings
+   jit->entry_size = jit->code_used;
+   void *exec = mmap(NULL,jit->entry_size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+   if(exec==MAP_FAILED)
+      return 1;
+   memcpy(exec,jit->code,jit->code_used);
+   if(mprotect(exec,jit->entry_size,PROT_READ|PROT_EXEC)!=0)
+   {
+      munmap(exec,jit->entry_size);
+      return 1;
+   }
+   jit->entry = (uint8_t *(*)(uint8_t *, Vm *))exec;
+
+   return 0;
+}
+
+static void jit_run(const Jit *jit, Vm *vm)
+{
+   vm->ptr = jit->entry(vm->ptr,vm);
+}
+
+static void jit_free(Jit *jit)
+{
+   if(jit->entry!=NULL)
+      munmap((void *)jit->entry,jit->entry_size);
+   if(jit->code!=NULL)
+      free(jit->code);
+
+   jit->code = NULL;
+   jit->code_used = 0;
+   jit->code_size = 0;
+   jit->entry = NULL;
+   jit->entry_size = 0;
+}
+
+#else
+
+static int jit_compile(const Bytecode *code, Jit *jit)
+{
+   fprintf(stderr,"-jit is not supported on this platform, falling back to interpreter\n");
+   return 1;
+}
+
+static void jit_run(const Jit *jit, Vm *vm)
+{
+}
+
+static void jit_free(Jit *jit)
+{
+}
+
+#endif
+
+//FNV-1a over the bytecode and its data, used as the -aot cache key
+static uint64_t bytecode_hash(const Bytecode *code)
+{
+   uint64_t hash = 0xcbf29ce484222325;
+   hash = (hash^AOT_VERSION)*0x100000001b3;
+   for(unsigned i = 0;i<code->code_used;i++)
+      hash = (hash^code->code[i])*0x100000001b3;
+   for(unsigned i = 0;i<code->data_used;i++)
+      hash = (hash^code->data[i])*0x100000001b3;
+
+   return hash;
+}
+
+#if AOT
+
+static int aot_get(void *io)
+{
+   return io_get(io);
+}
+
+static void aot_put(void *io, int c)
+{
+   io_put(io,c);
+}
+
+//Compiles the output of dump_c() to a shared object,
+//objects are cached in $XDG_CACHE_HOME/brainfuck (or ~/.cache/brainfuck)
+//by bytecode hash, so repeated runs skip the compiler
+static int aot_compile(const Bytecode *code, Aot *aot)
+{
+   char dir[1024];
+   const char *cache = getenv("XDG_CACHE_HOME");
+   const char *home = getenv("HOME");
+   if(cache!=NULL&&cache[0]!='\0')
+      snprintf(dir,sizeof(dir),"%s/brainfuck",cache);
+   else if(home!=NULL)
+      snprintf(dir,sizeof(dir),"%s/.cache/brainfuck",home);
+   else
+      snprintf(dir,sizeof(dir),"/tmp/brainfuck");
+
+   char path_so[1088];
+   snprintf(path_so,sizeof(path_so),"%s/%016"PRIx64".so",dir,bytecode_hash(code));
+
+   if(access(path_so,R_OK)!=0)
+   {
+      //Create cache directory (and ~/.cache if needed)
+      char *sep = strrchr(dir,'/');
+      if(sep!=NULL&&sep!=dir)
+      {
+         *sep = '\0';
+         mkdir(dir,0755);
+         *sep = '/';
+      }
+      mkdir(dir,0755);
+
+      //Compile to a temporary name first, concurrent runs (other
+      //processes or threads of -serve) never see half written objects
+      char path_c[1152];
+      char path_tmp[1152];
+      unsigned tmp = atomic_fetch_add(&aot_tmp_counter,1);
+      snprintf(path_c,sizeof(path_c),"%s.%d.%u.c",path_so,(int)getpid(),tmp);
+      snprintf(path_tmp,sizeof(path_tmp),"%s.%d.%u.tmp",path_so,(int)getpid(),tmp);
+
+      FILE *out = fopen(path_c,"w");
+      if(out==NULL)
+      {
+         fprintf(stderr,"-aot: failed to write %s, falling back to interpreter\n",path_c);
+         return 1;
+      }
+      dump_c(code,out,1);
+      fclose(out);
+
+      const char *cc = getenv("CC");
+      if(cc==NULL||cc[0]=='\0')
+         cc = "cc";
+      char cmd[4096];
+      snprintf(cmd,sizeof(cmd),"%s -O2 -shared -fPIC -o '%s' '%s'",cc,path_tmp,path_c);
+      int status = system(cmd);
+      remove(path_c);
+      if(status!=0||rename(path_tmp,path_so)!=0)
+      {
+         remove(path_tmp);
+         fprintf(stderr,"-aot: compiling with '%s' failed, falling back to interpreter\n",cc);
+         return 1;
+      }
+   }
+
+   aot->handle = dlopen(path_so,RTLD_NOW|RTLD_LOCAL);
+   if(aot->handle==NULL)
+   {
+      fprintf(stderr,"-aot: %s, falling back to interpreter\n",dlerror());
+      return 1;
+   }
+
+   *(void **)&aot->entry = dlsym(aot->handle,"bf_run");
+   if(aot->entry==NULL)
+   {
+      fprintf(stderr,"-aot: %s, falling back to interpreter\n",dlerror());
+      dlclose(aot->handle);
+      aot->handle = NULL;
+      return 1;
+   }
+
+   return 0;
+}
+
+static void aot_run(const Aot *aot, Vm *vm)
+{
+   vm->ptr = aot->entry(vm->ptr,&vm->io,aot_get,aot_put);
+}
+
+static void aot_free(Aot *aot)
+{
+   if(aot->handle!=NULL)
+      dlclose(aot->handle);
+
+   aot->handle = NULL;
+   aot->entry = NULL;
+}
+
+#else
+
+static int aot_compile(const Bytecode *code, Aot *aot)
+{
+   fprintf(stderr,"-aot is not supported on this platform, falling back to interpreter\n");
+   return 1;
+}
+
+static void aot_run(const Aot *aot, Vm *vm)
+{
+}
+
+static void aot_free(Aot *aot)
+{
+}
+
+#endif
+
+static void io_init(Io *io, FILE *input, FILE *output, int line_buffered)
+{
+   io->output = output;
+   io->out_used = 0;
+   io->line_buffered = line_buffered;
+   io->framed = 0;
+   io->input = input;
+   io->in_pos = io->in;
+   io->in_end = io->in;
+   io->in_map = NULL;
+   io->in_map_size = 0;
+
+#if defined(__unix__)
+   //Regular files get mapped as a whole,
+   //pipes and terminals are read in blocks
+   struct stat st;
+   if(input!=NULL&&fstat(fileno(input),&st)==0&&S_ISREG(st.st_mode)&&st.st_size>0)
+   {
+      void *map = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fileno(input),0);
+      if(map!=MAP_FAILED)
+      {
+         io->in_map = map;
+         io->in_map_size = st.st_size;
+         io->in_pos = io->in_map;
+         io->in_end = io->in_map+io->in_map_size;
+      }
+   }
+#endif
+}
+
+static int io_get(Io *io)
+{
+   if(io->in_pos==io->in_end&&!io_read(io))
+      return EOF;
+
+   return *io->in_pos++;
+}
+
+//Refills the input buffer,
+//returns 0 on end of input
+static int io_read(Io *io)
+{
+   if(io->in_map!=NULL||io->input==NULL)
+      return 0;
+
+   //Program is waiting for input,
+   //make sure prompts are visible
+   io_flush(io);
+
+#if defined(__unix__)
+   //read() returns whatever is available instead
+   //of waiting for a full block, needed for interactive use
+   ssize_t got = read(fileno(io->input),io->in,IO_BUFFER_SIZE);
+   if(got<=0)
+      return 0;
+#else
+   int c = fgetc(io->input);
+   if(c==EOF)
+      return 0;
+   io->in[0] = c;
+   int got = 1;
+#endif
+
+   io->in_pos = io->in;
+   io->in_end = io->in+got;
+
+   return 1;
+}
+
+static void io_put(Io *io, uint8_t c)
+{
+   io->out[io->out_used++] = c;
+
+   if(io->out_used==IO_BUFFER_SIZE||(io->line_buffered&&c=='\n'))
+      io_flush(io);
+}
+
+//Literal output (OP_WRITE),
+//large blocks bypass the buffer
+static void io_write(Io *io, const uint8_t *data, unsigned len)
+{
+   if(!io->line_buffered&&len>=IO_BUFFER_SIZE)
+   {
+      io_flush(io);
+      io_emit(io,data,len);
+      return;
+   }
+
+   for(unsigned i = 0;i<len;i++)
+      io_put(io,data[i]);
+}
+
+static void io_flush(Io *io)
+{
+   io_emit(io,io->out,io->out_used);
+   fflush(io->output);
+   io->out_used = 0;
+}
+
+//Writes a block to the output stream,
+//preceded by its length if framed
+static void io_emit(Io *io, const uint8_t *data, unsigned len)
+{
+   if(io->framed)
+   {
+      //Empty frames end the output
+      if(len==0)
+         return;
+      uint32_t frame = len;
+      fwrite(&frame,sizeof(frame),1,io->output);
+   }
+   fwrite(data,1,len,io->output);
+}
+
+static void io_free(Io *io)
+{
+   io_flush(io);
+
+#if defined(__unix__)
+   if(io->in_map!=NULL)
+      munmap(io->in_map,io->in_map_size);
+#endif
+   io->in_map = NULL;
+}
+
+static int vm_init(Vm *vm, FILE *input, FILE *output, int line_buffered)
+{
+   io_init(&vm->io,input,output,line_buffered);
+
+#if GUARD_TAPE
+   //Reserve address space only, pages get
+   //made accessible on first use
+   uint8_t *reserved = mmap(NULL,TAPE_SIZE+2*TAPE_GUARD,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+   if(reserved==MAP_FAILED)
+      return 1;
+
+   vm->tape_start = reserved+TAPE_GUARD;
+   vm->tape_end = vm->tape_start+TAPE_SIZE;
+   vm->ptr = vm->tape_start+TAPE_SIZE/2;
+   vm->tape_lo = vm->ptr-TAPE_COMMIT/2;
+   vm->tape_hi = vm->ptr+TAPE_COMMIT/2;
+   if(mprotect(vm->tape_lo,vm->tape_hi-vm->tape_lo,PROT_READ|PROT_WRITE)!=0)
+   {
+      munmap(reserved,TAPE_SIZE+2*TAPE_GUARD);
+      return 1;
+   }
+
+   struct sigaction sa = {0};
+   sa.sa_sigaction = tape_fault;
+   sa.sa_flags = SA_SIGINFO;
+   sigemptyset(&sa.sa_mask);
+   if(sigaction(SIGSEGV,&sa,NULL)!=0)
+      return 1;
+#else
+   vm->mem = calloc(MEM_SIZE,sizeof(*vm->mem));
+   if(vm->mem==NULL)
+      return 1;
+   vm->tape_start = vm->mem;
+   vm->tape_end = vm->mem+MEM_SIZE;
+   vm->ptr = vm->mem;
+#endif
+
+   return 0;
+}
+
+static void vm_free(Vm *vm)
+{
+   io_free(&vm->io);
+
+#if GUARD_TAPE
+   munmap(vm->tape_start-TAPE_GUARD,TAPE_SIZE+2*TAPE_GUARD);
+#else
+   free(vm->mem);
+   vm->mem = NULL;
+#endif
+   vm->tape_start = NULL;
+   vm->tape_end = NULL;
+   vm->ptr = NULL;
+}
+
+#if GUARD_TAPE
+
+//SIGSEGV handler
+//Accesses to the reserved, but inaccessible part of the tape
+//grow the accessible part (doubling it in the direction of the access),
+//accesses to the guard regions abort the program (see program_run())
+static void tape_fault(int sig, siginfo_t *info, void *context)
+{
+   (void)sig;
+   (void)context;
+
+   uint8_t *addr = info->si_addr;
+   Vm *vm = vm_current;
+
+   //Not caused by the tape (or already accessible),
+   //crash as usual when the instruction is retried
+   if(vm==NULL||addr<vm->tape_start-TAPE_GUARD||addr>=vm->tape_end+TAPE_GUARD||(addr>=vm->tape_lo&&addr<vm->tape_hi))
+   {
+      signal(SIGSEGV,SIG_DFL);
+      return;
+   }
+
+   if(addr<vm->tape_start||addr>=vm->tape_end)
+   {
+      vm->fault_cell = addr-(vm->tape_start+TAPE_SIZE/2);
+      siglongjmp(vm->fault,1);
+   }
+
+   uint8_t *lo = vm->tape_lo;
+   uint8_t *hi = vm->tape_hi;
+   while(addr<lo)
+      lo = lo-(hi-lo)<vm->tape_start?vm->tape_start:lo-(hi-lo);
+   while(addr>=hi)
+      hi = hi+(hi-lo)>vm->tape_end?vm->tape_end:hi+(hi-lo);
+
+   if(lo<vm->tape_lo)
+      mprotect(lo,vm->tape_lo-lo,PROT_READ|PROT_WRITE);
+   if(hi>vm->tape_hi)
+      mprotect(vm->tape_hi,hi-vm->tape_hi,PROT_READ|PROT_WRITE);
+   vm->tape_lo = lo;
+   vm->tape_hi = hi;
+}
+
+#endif
+
+//Compiles the program in path for the given backend,
+//the interpreter is used as a fallback
+//if native code can't be generated
+//With timing set, the time spent in each stage is reported on stderr
+static int program_load(Program *prog, const char *path, int bytecode, Backend backend, int eval, int superinstructions, int timing)
+{
+   double t = time_now();
+
+   //Already optimized
+   if(bytecode)
+   {
+      if(bytecode_load(&prog->code,path))
+         return 1;
+      if(timing)
+         t = time_report("load",t);
+      program_backend(prog,backend,superinstructions,timing,t);
+
+      return 0;
+   }
+
+   size_t len = 0;
+   int mapped = 0;
+   uint8_t *src = source_read(path,&len,&mapped);
+   if(src==NULL)
+      return 1;
+   if(timing)
+      time_report("read",t);
+
+   int status = program_compile(prog,src,len,backend,eval,superinstructions,timing);
+   source_free(src,len,mapped);
+
+   return status;
+}
+
+//Compiles source code held in memory, see program_load()
+static int program_compile(Program *prog, const uint8_t *src, size_t len, Backend backend, int eval, int superinstructions, int timing)
+{
+   double t = time_now();
+
+   bytecode_init(&prog->code);
+   if(compile(src,len,&prog->code))
+   {
+      bytecode_free(&prog->code);
+      return 1;
+   }
+   if(timing)
+   {
+      t = time_report("compile",t);
+      fprintf(stderr,"%-10s %zu bytes source, %u bytes bytecode\n","size",len,prog->code.code_used);
+   }
+
+   //Run everything up to the first input at compile time
+   if(eval)
+   {
+      partial_eval(&prog->code);
+      if(timing)
+         t = time_report("eval",t);
+   }
+
+   program_backend(prog,backend,superinstructions,timing,t);
+
+   return 0;
+}
+
+//Backend specific steps, shared by source and bytecode files
+static void program_backend(Program *prog, Backend backend, int superinstructions, int timing, double t)
+{
+   //Superinstructions are only understood by the interpreter
+   if(superinstructions&&backend==BACKEND_INTERPRETER)
+   {
+      fuse(&prog->code);
+      if(timing)
+         t = time_report("fuse",t);
+   }
+
+   prog->backend = backend;
+   memset(&prog->native,0,sizeof(prog->native));
+   memset(&prog->compiled,0,sizeof(prog->compiled));
+   if(backend==BACKEND_JIT&&jit_compile(&prog->code,&prog->native)!=0)
+      prog->backend = BACKEND_INTERPRETER;
+   else if(backend==BACKEND_AOT&&aot_compile(&prog->code,&prog->compiled)!=0)
+      prog->backend = BACKEND_INTERPRETER;
+   if(timing&&prog->backend!=BACKEND_INTERPRETER)
+      time_report(prog->backend==BACKEND_JIT?"jit":"aot",t);
+}
+
+//Reads a whole source file, mapping it if possible
+//(saves copying it), release with source_free()
+static uint8_t *source_read(const char *path, size_t *len, int *mapped)
+{
+   FILE *in = fopen(path,"rb");
+   if(in==NULL)
+      return NULL;
+
+   uint8_t *src = NULL;
+   *len = 0;
+   *mapped = 0;
+#if defined(__unix__)
+   struct stat st;
+   if(fstat(fileno(in),&st)==0&&S_ISREG(st.st_mode)&&st.st_size>0)
+   {
+      src = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fileno(in),0);
+      if(src==MAP_FAILED)
+      {
+         src = NULL;
+      }
+      else
+      {
+         madvise(src,st.st_size,MADV_SEQUENTIAL);
+         *len = st.st_size;
+         *mapped = 1;
+      }
+   }
+#endif
+
+   if(src==NULL)
+   {
+      size_t size = 1<<16;
+      src = malloc(size);
+      for(size_t r;(r = fread(src+*len,1,size-*len,in))>0;)
+      {
+         *len+=r;
+         if(*len==size)
+            src = realloc(src,size*=2);
+      }
+   }
+   fclose(in);
+
+   return src;
+}
+
+static void source_free(uint8_t *src, size_t len, int mapped)
+{
+#if defined(__unix__)
+   if(mapped)
+   {
+      munmap(src,len);
+      return;
+   }
+#endif
+   free(src);
+}
+
+//Monotonic time in seconds
+static double time_now(void)
+{
+#if defined(__unix__)
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC,&ts);
+   return ts.tv_sec+ts.tv_nsec*1e-9;
+#else
+   return (double)clock()/CLOCKS_PER_SEC;
+#endif
+}
+
+//Prints the time passed since start, returns the current time
+static double time_report(const char *stage, double start)
+{
+   double now = time_now();
+   fprintf(stderr,"%-10s %10.3f ms\n",stage,(now-start)*1e3);
+   return now;
+}
+
+//Returns non-zero if the program was aborted
+//because of an out of range tape access
+static int program_run(const Program *prog, Vm *vm)
+{
+#if GUARD_TAPE
+   vm_current = vm;
+   if(sigsetjmp(vm->fault,1))
+   {
+      vm_current = NULL;
+      return 1;
+   }
+#endif
+
+   switch(prog->backend)
+   {
+   case BACKEND_INTERPRETER: bytecode_run(&prog->code,vm); break;
+   case BACKEND_JIT: jit_run(&prog->native,vm); break;
+   case BACKEND_AOT: aot_run(&prog->compiled,vm); break;
+   }
+
+#if GUARD_TAPE
+   vm_current = NULL;
+#endif
+
+   return 0;
+}
+
+static void program_free(Program *prog)
+{
+   jit_free(&prog->native);
+   aot_free(&prog->compiled);
+   bytecode_free(&prog->code);
+}
+
+//Reads the job list and compiles every distinct program once,
+//workers share the compiled programs
+static int batch_load(Batch *batch, const char *path, Backend backend, int eval, int superinstructions)
+{
+   FILE *f = fopen(path,"r");
+   if(f==NULL)
+      return 1;
+
+   int jobs_size = 0;
+   char program[1024];
+   char input[1024];
+   char output[1024];
+   while(fscanf(f,"%1023s %1023s %1023s",program,input,output)==3)
+   {
+      if(batch->jobs_used==jobs_size)
+      {
+         jobs_size = jobs_size*2+64;
+         batch->program = realloc(batch->program,sizeof(*batch->program)*jobs_size);
+         batch->input = realloc(batch->input,sizeof(*batch->input)*jobs_size);
+         batch->output = realloc(batch->output,sizeof(*batch->output)*jobs_size);
+         batch->compiled = realloc(batch->compiled,sizeof(*batch->compiled)*jobs_size);
+      }
+
+      int job = batch->jobs_used++;
+      batch->program[job] = strdup(program);
+      batch->input[job] = strcmp(input,"-")==0?NULL:strdup(input);
+      batch->output[job] = strdup(output);
+      batch->compiled[job] = NULL;
+
+      for(int i = 0;i<job;i++)
+      {
+         if(strcmp(batch->program[i],program)==0)
+         {
+            batch->compiled[job] = batch->compiled[i];
+            break;
+         }
+      }
+
+      if(batch->compiled[job]==NULL)
+      {
+         Program *prog = malloc(sizeof(*prog));
+         if(program_load(prog,program,0,backend,eval,superinstructions,0))
+         {
+            fprintf(stderr,"%s: failed to load\n",program);
+            free(prog);
+            batch->failed++;
+            continue;
+         }
+         batch->compiled[job] = prog;
+      }
+   }
+   fclose(f);
+
+   return 0;
+}
+
+static void batch_run(Batch *batch, int threads)
+{
+   batch->next = 0;
+
+#if defined(__unix__)
+   if(threads<=0)
+      threads = sysconf(_SC_NPROCESSORS_ONLN);
+   if(threads<=0)
+      threads = 1;
+
+   pthread_mutex_init(&batch->lock,NULL);
+   pthread_t *workers = malloc(sizeof(*workers)*threads);
+   int started = 0;
+   for(;started<threads;started++)
+      if(pthread_create(&workers[started],NULL,batch_worker,batch)!=0)
+         break;
+
+   //Run on this thread if no worker could be started
+   if(started==0)
+      batch_worker(batch);
+   for(int i = 0;i<started;i++)
+      pthread_join(workers[i],NULL);
+
+   free(workers);
+   pthread_mutex_destroy(&batch->lock);
+#else
+   batch_worker(batch);
+#endif
+}
+
+static void *batch_worker(void *arg)
+{
+   Batch *batch = arg;
+   Vm *vm = malloc(sizeof(*vm));
+
+   for(;;)
+   {
+#if defined(__unix__)
+      pthread_mutex_lock(&batch->lock);
+#endif
+      int job = batch->next++;
+#if defined(__unix__)
+      pthread_mutex_unlock(&batch->lock);
+#endif
+      if(job>=batch->jobs_used)
+         break;
+      if(batch->compiled[job]==NULL)
+         continue;
+
+      int failed = 0;
+      FILE *input = NULL;
+      FILE *output = fopen(batch->output[job],"wb");
+      if(batch->input[job]!=NULL)
+         input = fopen(batch->input[job],"rb");
+
+      if(output==NULL||(batch->input[job]!=NULL&&input==NULL))
+      {
+         fprintf(stderr,"%s: failed to open %s\n",batch->program[job],output==NULL?batch->output[job]:batch->input[job]);
+         failed = 1;
+      }
+      else if(vm_init(vm,input,output,batch->line_buffered))
+      {
+         fprintf(stderr,"%s: failed to allocate tape\n",batch->program[job]);
+         failed = 1;
+      }
+      else
+      {
+         if(program_run(batch->compiled[job],vm))
+         {
+#if GUARD_TAPE
+            fprintf(stderr,"%s: tape access out of range (cell %"PRId64")\n",batch->program[job],vm->fault_cell);
+#endif
+            failed = 1;
+         }
+         vm_free(vm);
+      }
+
+      if(input!=NULL)
+         fclose(input);
+      if(output!=NULL)
+         fclose(output);
+
+      if(failed)
+      {
+#if defined(__unix__)
+         pthread_mutex_lock(&batch->lock);
+#endif
+         batch->failed++;
+#if defined(__unix__)
+         pthread_mutex_unlock(&batch->lock);
+#endif
+      }
+   }
+
+   free(vm);
+
+   return NULL;
+}
+
+static void batch_free(Batch *batch)
+{
+   for(int i = 0;i<batch->jobs_used;i++)
+   {
+      //Programs are shared between jobs,
+      //only the first job using it frees it
+      int first = batch->compiled[i]!=NULL;
+      for(int j = 0;j<i&&first;j++)
+         if(batch->compiled[j]==batch->compiled[i])
+            first = 0;
+      if(first)
+      {
+         program_free(batch->compiled[i]);
+         free(batch->compiled[i]);
+      }
+
+      free(batch->program[i]);
+      free(batch->input[i]);
+      free(batch->output[i]);
+   }
+
+   free(batch->program);
+   free(batch->input);
+   free(batch->output);
+   free(batch->compiled);
+}
+
+//FNV-1a over the source, identifies programs in the -serve cache
+static uint64_t source_hash(const uint8_t *src, size_t len)
+{
+   uint64_t hash = 0xcbf29ce484222325;
+   for(size_t i = 0;i<len;i++)
+      hash = (hash^src[i])*0x100000001b3;
+
+   return hash;
+}
+
+#if defined(__unix__)
+
+//Listens on the unix socket at path, every connection runs one
+//program on its own thread, compiled programs are kept in a
+//least recently used cache of (at most) cache_max entries
+//Only returns if the socket can't be set up
+static int serve(const char *path, int cache_max, Backend backend, int eval, int superinstructions)
+{
+   struct sockaddr_un addr = {0};
+   addr.sun_family = AF_UNIX;
+   if(strlen(path)>=sizeof(addr.sun_path))
+      return 1;
+   strcpy(addr.sun_path,path);
+
+   //Remove the socket of a previous run,
+   //but never anything else
+   struct stat st;
+   if(stat(path,&st)==0&&S_ISSOCK(st.st_mode))
+      unlink(path);
+
+   int fd = socket(AF_UNIX,SOCK_STREAM,0);
+   if(fd<0)
+      return 1;
+   if(bind(fd,(struct sockaddr *)&addr,sizeof(addr))!=0||listen(fd,SOMAXCONN)!=0)
+   {
+      close(fd);
+      return 1;
+   }
+
+   //Clients hanging up early must not take the server down
+   signal(SIGPIPE,SIG_IGN);
+
+   Server server = {0};
+   server.cache_max = cache_max>0?cache_max:SERVE_CACHE;
+   server.backend = backend;
+   server.eval = eval;
+   server.superinstructions = superinstructions;
+   pthread_mutex_init(&server.lock,NULL);
+
+   for(;;)
+   {
+      int client = accept(fd,NULL,NULL);
+      if(client<0)
+      {
+         if(errno==EINTR||errno==ECONNABORTED)
+            continue;
+         break;
+      }
+
+      ServeConnection *conn = malloc(sizeof(*conn));
+      conn->server = &server;
+      conn->fd = client;
+      pthread_t thread;
+      if(pthread_create(&thread,NULL,serve_connection,conn)!=0)
+         serve_connection(conn);
+      else
+         pthread_detach(thread);
+   }
+
+   close(fd);
+
+   return 1;
+}
+
+//Handles a single request, see ServeRequest
+static void *serve_connection(void *arg)
+{
+   ServeConnection *conn = arg;
+   Server *server = conn->server;
+   int fd = conn->fd;
+   free(conn);
+
+   ServeRequest req;
+   ServeResponse res = {{'B','F','R','S'},SERVE_INVALID};
+   Program *prog = NULL;
+   if(serve_read(fd,&req,sizeof(req))==0&&memcmp(req.magic,"BFRQ",4)==0)
+   {
+      uint8_t *src = NULL;
+      if(req.flags&SERVE_SOURCE)
+      {
+         src = malloc(req.source_len>0?req.source_len:1);
+         if(src!=NULL&&serve_read(fd,src,req.source_len)==0)
+            prog = serve_acquire(server,&req,src,&res.status);
+      }
+      else
+      {
+         prog = serve_acquire(server,&req,NULL,&res.status);
+      }
+      free(src);
+   }
+
+   if(serve_write(fd,&res,sizeof(res))!=0||prog==NULL)
+   {
+      if(prog!=NULL)
+         serve_release(server,prog);
+      close(fd);
+      return NULL;
+   }
+
+   //Input is read with read() (see io_read()),
+   //so nothing sent after the request is lost in stdio buffers
+   FILE *input = fdopen(dup(fd),"rb");
+   FILE *output = fdopen(dup(fd),"wb");
+   ServeResult result = {0};
+   Vm *vm = malloc(sizeof(*vm));
+   if(input==NULL||output==NULL||vm_init(vm,input,output,req.flags&SERVE_LINE))
+   {
+      result.status = SERVE_NO_TAPE;
+   }
+   else
+   {
+      vm->io.framed = 1;
+      if(program_run(prog,vm))
+      {
+         result.status = SERVE_FAULT;
+#if GUARD_TAPE
+         result.fault_cell = vm->fault_cell;
+#endif
+      }
+      vm_free(vm);
+   }
+   free(vm);
+   serve_release(server,prog);
+
+   if(output!=NULL)
+   {
+      uint32_t end = 0;
+      fwrite(&end,sizeof(end),1,output);
+      fwrite(&result,sizeof(result),1,output);
+      fclose(output);
+   }
+   if(input!=NULL)
+      fclose(input);
+   close(fd);
+
+   return NULL;
+}
+
+//Finds the requested program in the cache, compiling it if
+//the source was sent, the program can't be evicted
+//until released with serve_release()
+static Program *serve_acquire(Server *server, const ServeRequest *req, const uint8_t *src, uint32_t *status)
+{
+   uint64_t hash = src!=NULL?source_hash(src,req->source_len):req->hash;
+
+   pthread_mutex_lock(&server->lock);
+   Program *prog = serve_find(server,hash);
+   pthread_mutex_unlock(&server->lock);
+   if(prog!=NULL||src==NULL)
+   {
+      *status = prog!=NULL?SERVE_OK:SERVE_UNKNOWN;
+      return prog;
+   }
+
+   //Compiled without holding the lock,
+   //so other connections aren't blocked
+   prog = malloc(sizeof(*prog));
+   if(program_compile(prog,src,req->source_len,server->backend,server->eval,server->superinstructions,0))
+   {
+      free(prog);
+      *status = SERVE_INVALID;
+      return NULL;
+   }
+   *status = SERVE_OK;
+
+   pthread_mutex_lock(&server->lock);
+
+   //Another connection might have compiled it in the meantime
+   Program *cached = serve_find(server,hash);
+   if(cached!=NULL)
+   {
+      pthread_mutex_unlock(&server->lock);
+      program_free(prog);
+      free(prog);
+      return cached;
+   }
+
+   //Evict the least recently used programs nobody is running,
+   //the cache grows past cache_max if all of them are in use
+   while(server->cache_used>=server->cache_max)
+   {
+      int lru = -1;
+      for(int i = 0;i<server->cache_used;i++)
+         if(server->cache[i].users==0&&(lru<0||server->cache[i].used<server->cache[lru].used))
+            lru = i;
+      if(lru<0)
+         break;
+
+      program_free(server->cache[lru].prog);
+      free(server->cache[lru].prog);
+      server->cache[lru] = server->cache[--server->cache_used];
+   }
+
+   if(server->cache_used==server->cache_size)
+   {
+      server->cache_size = server->cache_size*2+16;
+      server->cache = realloc(server->cache,sizeof(*server->cache)*server->cache_size);
+   }
+   ServeEntry *entry = &server->cache[server->cache_used++];
+   entry->hash = hash;
+   entry->prog = prog;
+   entry->users = 1;
+   entry->used = ++server->clock;
+
+   pthread_mutex_unlock(&server->lock);
+
+   return prog;
+}
+
+//Caller must hold the lock
+static Program *serve_find(Server *server, uint64_t hash)
+{
+   for(int i = 0;i<server->cache_used;i++)
+   {
+      if(server->cache[i].hash==hash)
+      {
+         server->cache[i].users++;
+         server->cache[i].used = ++server->clock;
+         return server->cache[i].prog;
+      }
+   }
+
+   return NULL;
+}
+
+static void serve_release(Server *server, Program *prog)
+{
+   pthread_mutex_lock(&server->lock);
+   for(int i = 0;i<server->cache_used;i++)
+      if(server->cache[i].prog==prog)
+         server->cache[i].users--;
+   pthread_mutex_unlock(&server->lock);
+}
+
+//Runs the program in path on the server listening at socket_path,
+//input and output are those of this process
+//Returns the exit status for main()
+static int serve_connect(const char *socket_path, const char *path, const char *path_io, int line_buffered)
+{
+   struct sockaddr_un addr = {0};
+   addr.sun_family = AF_UNIX;
+   if(strlen(socket_path)>=sizeof(addr.sun_path))
+   {
+      fprintf(stderr,"Socket path %s too long\n",socket_path);
+      return 1;
+   }
+   strcpy(addr.sun_path,socket_path);
+
+   //The server stops reading input once the program ends
+   signal(SIGPIPE,SIG_IGN);
+
+   FILE *input = stdin;
+   if(path_io!=NULL&&(input = fopen(path_io,"rb"))==NULL)
+   {
+      fprintf(stderr,"Failed to open input file %s\n",path_io);
+      return 1;
+   }
+
+   size_t len = 0;
+   int mapped = 0;
+   uint8_t *src = source_read(path,&len,&mapped);
+   if(src==NULL)
+   {
+      fprintf(stderr,"Failed to open file %s\n",path);
+      return 1;
+   }
+
+   ServeRequest req;
+   memset(&req,0,sizeof(req));
+   memcpy(req.magic,"BFRQ",4);
+   req.flags = line_buffered?SERVE_LINE:0;
+   req.hash = source_hash(src,len);
+
+   //Ask for the cached program first,
+   //the source is only sent if the server doesn't know it
+   int fd = -1;
+   ServeResponse res = {{0},SERVE_INVALID};
+   for(int attempt = 0;attempt<2;attempt++)
+   {
+      fd = socket(AF_UNIX,SOCK_STREAM,0);
+      if(fd<0||connect(fd,(struct sockaddr *)&addr,sizeof(addr))!=0)
+         break;
+
+      if(attempt==1)
+      {
+         req.flags|=SERVE_SOURCE;
+         req.source_len = len;
+      }
+      if(serve_write(fd,&req,sizeof(req))!=0||
+         (attempt==1&&serve_write(fd,src,len)!=0)||
+         serve_read(fd,&res,sizeof(res))!=0||
+         memcmp(res.magic,"BFRS",4)!=0)
+         break;
+      if(res.status!=SERVE_UNKNOWN)
+         break;
+
+      close(fd);
+      fd = -1;
+   }
+   source_free(src,len,mapped);
+
+   if(fd<0||res.status!=SERVE_OK)
+   {
+      if(fd<0||memcmp(res.magic,"BFRS",4)!=0)
+         fprintf(stderr,"Failed to connect to %s\n",socket_path);
+      else
+         fprintf(stderr,"Failed to compile file %s\n",path);
+      if(fd>=0)
+         close(fd);
+      if(input!=stdin)
+         fclose(input);
+      return 1;
+   }
+
+   //Input is sent while output is received,
+   //the program might wait for input before finishing its output
+   ServePump *pump = malloc(sizeof(*pump));
+   pump->fd = fd;
+   pump->input = input;
+   pthread_t thread;
+   if(pthread_create(&thread,NULL,serve_pump,pump)!=0)
+      serve_pump(pump);
+   else
+      pthread_detach(thread);
+
+   int status = 1;
+   uint8_t buffer[IO_BUFFER_SIZE];
+   for(;;)
+   {
+      uint32_t frame;
+      if(serve_read(fd,&frame,sizeof(frame))!=0)
+      {
+         fprintf(stderr,"Lost connection to %s\n",socket_path);
+         break;
+      }
+
+      if(frame==0)
+      {
+         ServeResult result;
+         if(serve_read(fd,&result,sizeof(result))!=0)
+            fprintf(stderr,"Lost connection to %s\n",socket_path);
+         else if(result.status==SERVE_FAULT)
+            fprintf(stderr,"Tape access out of range (cell %"PRId64")\n",result.fault_cell);
+         else if(result.status==SERVE_NO_TAPE)
+            fprintf(stderr,"Failed to allocate tape\n");
+         else
+            status = 0;
+         break;
+      }
+
+      while(frame>0)
+      {
+         uint32_t part = frame<sizeof(buffer)?frame:sizeof(buffer);
+         if(serve_read(fd,buffer,part)!=0)
+            break;
+         fwrite(buffer,1,part,stdout);
+         frame-=part;
+      }
+      fflush(stdout);
+      if(frame>0)
+      {
+         fprintf(stderr,"Lost connection to %s\n",socket_path);
+         break;
+      }
+   }
+
+   //The input thread might still be blocked reading input
+   //nobody needs, it (and the connection) end with the process
+   return status;
+}
+
+//Sends the input to the server, then closes the writing
+//side of the connection, which is seen as end of input
+static void *serve_pump(void *arg)
+{
+   ServePump *pump = arg;
+   uint8_t buffer[IO_BUFFER_SIZE];
+
+   for(;;)
+   {
+      ssize_t got = read(fileno(pump->input),buffer,sizeof(buffer));
+      if(got<=0||serve_write(pump->fd,buffer,got)!=0)
+         break;
+   }
+   shutdown(pump->fd,SHUT_WR);
+   free(pump);
+
+   return NULL;
+}
+
+//Reads exactly len bytes, returns non-zero
+//if the connection ends before that
+static int serve_read(int fd, void *buffer, size_t len)
+{
+   uint8_t *pos = buffer;
+   while(len>0)
+   {
+      ssize_t got = read(fd,pos,len);
+      if(got<0&&errno==EINTR)
+         continue;
+      if(got<=0)
+         return 1;
+      pos+=got;
+      len-=got;
+   }
+
+   return 0;
+}
+
+static int serve_write(int fd, const void *buffer, size_t len)
+{
+   const uint8_t *pos = buffer;
+   while(len>0)
+   {
+      ssize_t put = write(fd,pos,len);
+      if(put<0&&errno==EINTR)
+         continue;
+      if(put<=0)
+         return 1;
+      pos+=put;
+      len-=put;
+   }
+
+   return 0;
+}
+
+#else
+
+static int serve(const char *path, int cache_max, Backend backend, int eval, int superinstructions)
+{
+   fprintf(stderr,"-serve is not supported on this platform\n");
+   return 1;
+}
+
+static int serve_connect(const char *socket_path, const char *path, const char *path_io, int line_buffered)
+{
+   fprintf(stderr,"-connect is not supported on this platform\n");
+   return 1;
+}
+
+#endif
+
 #undef MEM_SIZE
+#undef GUARD_TAPE
+#undef TAPE_SIZE
+#undef TAPE_GUARD
+#undef TAPE_COMMIT
+#undef IO_BUFFER_SIZE
+#undef EVAL_STEPS
+#undef EVAL_TAPE
 #undef READ_ARG
 #undef ABS
+#undef ARG32
+#undef OP_COUNT
 #undef COMPUTED_GOTO
+#undef JIT
+#undef AOT
+#undef AOT_VERSION
+#undef SERVE_CACHE
+#undef BYTECODE_VERSION
 //-------------------------------------
@@ -10,9 +10,20 @@ You should have received a copy of the CC0 Public Domain Dedication along with t
 
 //External includes
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <time.h>
 
+#if defined(__unix__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define HLH_STREAM_IMPLEMENTATION
+#include "../single_header/HLH_stream.h"
+
 #define OPTPARSE_IMPLEMENTATION
 #define OPTPARSE_API static
 #include "../external/optparse.h"
@@ -23,11 +34,17 @@ You should have received a copy of the CC0 Public Domain Dedication along with t
 #define HLH_MARKOV_ORDER_MIN_CHAR 2
 #define HLH_MARKOV_ORDER_WORD 3
 #define HLH_MARKOV_ORDER_MIN_WORD 2
+#if defined(__unix__)
+#define HLH_MARKOV_THREADS
+#endif
 #define HLH_MARKOV_IMPLEMENTATION
 #include "../single_header/HLH_markov.h"
 //-------------------------------------
 
 //#defines
+//Input is read in chunks of this size, each
+//chunk gets split into shards for training
+#define CHUNK_SIZE (1<<24)
 //-------------------------------------
 
 //Typedefs
@@ -38,28 +55,44 @@ You should have received a copy of the CC0 Public Domain Dedication along with t
 
 //Function prototypes
 static void print_help(char **argv);
-static char *file_read(const char *path);
+static HLH_markov_model *model_train(HLH_rw *rw, int mode, int threads, int order, size_t budget);
+static HLH_markov_model *model_load(const char *path, void **map, size_t *map_size);
 //-------------------------------------
 
 //Function implementations
 
 int main(int argc, char **argv)
 {
-   srand(time(NULL));
-
    //Parse arguments
    struct optparse_long longopts[] =
    {
       {"in", 'i', OPTPARSE_REQUIRED},
+      {"stdin", 'I', OPTPARSE_NONE},
       {"gen", 'g', OPTPARSE_REQUIRED},
       {"text", 't', OPTPARSE_NONE},
       {"word", 'w', OPTPARSE_NONE},
+      {"save", 's', OPTPARSE_REQUIRED},
+      {"load", 'l', OPTPARSE_REQUIRED},
+      {"threads", 'j', OPTPARSE_REQUIRED},
+      {"order", 'o', OPTPARSE_REQUIRED},
+      {"prune", 'p', OPTPARSE_REQUIRED},
+      {"budget", 'b', OPTPARSE_REQUIRED},
       {"help", 'h', OPTPARSE_NONE},
       {0},
    };
    const char *path = NULL;
+   int path_stdin = 0;
+   const char *path_save = NULL;
+   const char *path_load = NULL;
    int mode = 0;
    int gen = 1;
+   int threads = 1;
+   int order = 0;
+   int prune = 0;
+   size_t budget = 0;
+#if defined(__unix__)
+   threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
 
    int option;
    struct optparse options;
@@ -71,6 +104,9 @@ int main(int argc, char **argv)
       case 'i':
          path = options.optarg;
          break;
+      case 'I':
+         path_stdin = 1;
+         break;
       case 'g':
          gen = strtol(options.optarg,NULL,10);
          break;
@@ -80,6 +116,24 @@ int main(int argc, char **argv)
       case 'w':
          mode = 0;
          break;
+      case 's':
+         path_save = options.optarg;
+         break;
+      case 'l':
+         path_load = options.optarg;
+         break;
+      case 'j':
+         threads = strtol(options.optarg,NULL,10);
+         break;
+      case 'o':
+         order = strtol(options.optarg,NULL,10);
+         break;
+      case 'p':
+         prune = strtol(options.optarg,NULL,10);
+         break;
+      case 'b':
+         budget = strtoull(options.optarg,NULL,10);
+         break;
       case 'h':
          print_help(argv);
          exit(EXIT_SUCCESS);
@@ -91,79 +145,94 @@ int main(int argc, char **argv)
       }
    }
 
-   if(path==NULL)
+   if(path==NULL&&!path_stdin&&path_load==NULL)
    {
       printf("No input file specified, try %s -h for help\n",argv[0]);
       return 0;
    }
 
-   if(mode==0)
+   void *map = NULL;
+   size_t map_size = 0;
+   HLH_markov_model *model = NULL;
+   if(path_load!=NULL)
    {
-      HLH_markov_model *model_char = HLH_markov_model_new(HLH_MARKOV_CHAR);
-
-      char *file = file_read(path);
-      char *str = file;
-      char *ptr = file;
-      while(*ptr++!='\0')
+      model = model_load(path_load,&map,&map_size);
+      if(model==NULL)
       {
-         if(*ptr=='\n')
-         {
-            *ptr = '\0';
-            HLH_markov_model_add(model_char,str);
-            ptr++;
-            str = ptr;
-         }
+         fprintf(stderr,"Failed to load model %s\n",path_load);
+         return 1;
       }
-      free(file);
-
-      for(int i = 0;i<gen;i++)
+   }
+   else
+   {
+      FILE *in = path_stdin?stdin:fopen(path,"rb");
+      if(in==NULL)
       {
-         char *text = HLH_markov_model_generate(model_char);
-         puts(text);
-         free(text);
+         fprintf(stderr,"Failed to open %s\n",path);
+         return 1;
       }
-      printf("size: %d\n",HLH_markov_model_size(model_char));
-      int max = 0;
-      for(int i = 0;i<256;i++)
+
+      HLH_rw rw;
+      HLH_rw_init_file(&rw,in);
+      model = model_train(&rw,mode,threads,order,budget);
+      if(in!=stdin)
+         fclose(in);
+      if(model==NULL)
       {
-         for(int j = 0;j<model_char->as.mchar.contexts[i].data_used;j++)
-         {
-            for(int c = 0;c<256;c++)
-            {
-               if(model_char->as.mchar.contexts[i].data[j].counts[c]>max)
-                  max = model_char->as.mchar.contexts[i].data[j].counts[c];
-            }
-         }
+         fprintf(stderr,"Invalid order %d\n",order);
+         return 1;
       }
-      HLH_markov_model_delete(model_char);
+      if(prune>1)
+         HLH_markov_model_prune(model,prune);
+      HLH_markov_model_freeze(model);
    }
-   else if(mode==1)
-   {
-      HLH_markov_model *model_word = HLH_markov_model_new(HLH_MARKOV_WORD);
 
-      char *file = file_read(path);
-      char *str = file;
-      char *ptr = file;
-      while(*ptr++!='\0')
+   if(path_save!=NULL)
+   {
+      int saved = -1;
+      FILE *f = fopen(path_save,"wb");
+      if(f!=NULL)
       {
-         if(*ptr=='#')
-         {
-            *ptr = '\0';
-            HLH_markov_model_add(model_word,str);
-            ptr++;
-            str = ptr;
-         }
+         HLH_rw rw;
+         HLH_rw_init_file(&rw,f);
+         saved = HLH_markov_model_save(model,&rw);
+         if(fclose(f)!=0)
+            saved = -1;
       }
-      free(file);
+      if(saved!=0)
+         fprintf(stderr,"Failed to save model to %s\n",path_save);
+   }
 
-      for(int i = 0;i<gen;i++)
+   //Generate in batches, the arena is reused
+   static char buffer[1<<16];
+   HLH_markov_rng rng;
+   HLH_markov_rng_seed(&rng,time(NULL));
+   for(int i = 0;i<gen;)
+   {
+      HLH_markov_arena arena = {0};
+      arena.data = buffer;
+      arena.data_size = sizeof(buffer);
+
+      size_t count = HLH_markov_model_generate_batch(model,&rng,gen-i,&arena);
+      if(count==0)
+         break;
+
+      const char *text = arena.data;
+      for(size_t j = 0;j<count;j++)
       {
-         char *text = HLH_markov_model_generate(model_word);
          puts(text);
-         free(text);
+         text+=strlen(text)+1;
       }
-      HLH_markov_model_delete(model_word);
+      i+=count;
    }
+   if(model->type==HLH_MARKOV_CHAR)
+      printf("size: %zu\n",HLH_markov_model_size(model));
+   HLH_markov_model_delete(model);
+
+#if defined(__unix__)
+   if(map!=NULL)
+      munmap(map,map_size);
+#endif
 
    return 0;
 }
@@ -173,24 +242,111 @@ static void print_help(char **argv)
    printf("%s usage:\n"
           "Generate random words/texts with markov chains\n"
           "   -i        file to read input from\n"
+          "   --stdin   read input from stdin instead of -i\n"
           "   --word    word generation mode\n"
           "   --text    text generation mode\n"
-          "   --gen NUM amount of phrases to generate\n",
+          "   --gen NUM amount of phrases to generate\n"
+          "   --save FILE save the model to FILE\n"
+          "   --load FILE use a model saved with --save instead of -i\n"
+          "   --threads NUM amount of threads to train with (default: all cores)\n"
+          "   --order NUM use contexts of up to NUM (at least NUM-1) words/characters\n"
+          "   --prune NUM drop contexts (longer than one word/character) seen less than NUM times\n"
+          "   --budget BYTES prune while training to keep the model below BYTES\n",
          argv[0],argv[0]);
 }
 
-static char *file_read(const char *path)
+//Char mode splits the input at newlines, text mode at '#'
+//order 0 uses the compiled in order, budget 0 is unlimited
+//The input is streamed, only the parts completed by a chunk are
+//added, the unfinished last one is moved to the next chunk
+static HLH_markov_model *model_train(HLH_rw *rw, int mode, int threads, int order, size_t budget)
 {
-   FILE *f = fopen(path,"r");
-   int size = 0;
-   fseek(f,0,SEEK_END);
-   size = ftell(f);
-   fseek(f,0,SEEK_SET);
-   char *text = malloc(sizeof(*text)*(size+1));
-   fread(text,size,1,f);
-   text[size] = '\0';
+   HLH_markov_model_type type = mode==0?HLH_MARKOV_CHAR:HLH_MARKOV_WORD;
+   HLH_markov_model *model = NULL;
+   if(order>0)
+      model = HLH_markov_model_new_trie(type,order,order>1?order-1:1);
+   else
+      model = HLH_markov_model_new(type);
+   if(model==NULL)
+      return NULL;
+   HLH_markov_model_set_budget(model,budget);
+
+   char sep = mode==0?'\n':'#';
+
+   size_t buffer_size = CHUNK_SIZE;
+   size_t buffer_used = 0;
+   char *buffer = malloc(buffer_size);
+   for(;;)
+   {
+      //Part longer than a chunk
+      if(buffer_used==buffer_size)
+      {
+         buffer_size*=2;
+         buffer = realloc(buffer,buffer_size);
+      }
+
+      size_t read = HLH_rw_read(rw,buffer+buffer_used,1,buffer_size-buffer_used);
+      if(read==0)
+         break;
+      buffer_used+=read;
+
+      size_t len = buffer_used;
+      while(len>0&&buffer[len-1]!=sep)
+         len--;
+      if(len==0)
+         continue;
+
+      HLH_markov_model_add_text(model,buffer,len,sep,threads);
+      memmove(buffer,buffer+len,buffer_used-len);
+      buffer_used-=len;
+   }
+
+   //Input doesn't need to end with a separator
+   HLH_markov_model_add_text(model,buffer,buffer_used,sep,threads);
+   free(buffer);
+
+   return model;
+}
+
+//Maps the model file if possible (shared between
+//all processes using it), release map with munmap()
+//after deleting the model
+static HLH_markov_model *model_load(const char *path, void **map, size_t *map_size)
+{
+   FILE *f = fopen(path,"rb");
+   if(f==NULL)
+      return NULL;
+
+   *map = NULL;
+   *map_size = 0;
+#if defined(__unix__)
+   struct stat st;
+   if(fstat(fileno(f),&st)==0&&S_ISREG(st.st_mode)&&st.st_size>0)
+   {
+      void *mem = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fileno(f),0);
+      if(mem!=MAP_FAILED)
+      {
+         fclose(f);
+
+         HLH_markov_model *model = HLH_markov_model_load_mem(mem,st.st_size);
+         if(model==NULL)
+         {
+            munmap(mem,st.st_size);
+            return NULL;
+         }
+
+         *map = mem;
+         *map_size = st.st_size;
+         return model;
+      }
+   }
+#endif
+
+   HLH_rw rw;
+   HLH_rw_init_file(&rw,f);
+   HLH_markov_model *model = HLH_markov_model_load(&rw);
    fclose(f);
 
-   return text;
+   return model;
 }
 //-------------------------------------
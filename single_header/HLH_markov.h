@@ -26,15 +26,26 @@
    HLH_MARKOV_RAND
 */
 
+/*
+   HLH_markov_model_add_text() trains in parallel if
+   HLH_MARKOV_THREADS is defined (uses pthreads)
+*/
+
+/*
+   HLH_markov_model_save() and HLH_markov_model_load() are
+   only available if HLH_stream.h is included before this file
+*/
+
 #define _HLH_MARKOV_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct HLH_markov_context_char HLH_markov_context_char;
+typedef struct HLH_markov_context_word HLH_markov_context_word;
 typedef struct HLH_markov_count HLH_markov_count;
-
-typedef struct HLH_markov_word_node HLH_markov_word_node;
-typedef struct HLH_markov_char_node HLH_markov_char_node;
+typedef struct HLH_markov_trie_node HLH_markov_trie_node;
+typedef struct HLH_markov_frozen HLH_markov_frozen;
 
 typedef enum
 {
@@ -46,13 +57,6 @@ typedef enum
 //I used to use macors for dynamic arrays, but
 //a lot of the time you need just a little
 //more flexibility, so I have seperate implementations instead
-typedef struct
-{
-   char **data;
-   int32_t data_used;
-   int32_t data_size;
-}HLH_markov_str_array;
-
 typedef struct
 {
    int32_t *data;
@@ -74,6 +78,13 @@ typedef struct
    int32_t data_size;
 }HLH_markov_context_char_array;
 
+typedef struct
+{
+   HLH_markov_context_word *data;
+   int32_t data_used;
+   int32_t data_size;
+}HLH_markov_context_word_array;
+
 typedef struct
 {
    HLH_markov_count *data;
@@ -81,37 +92,208 @@ typedef struct
    int32_t data_size;
 }HLH_markov_count_array;
 
+//Symbols strings start with, counted like the
+//successors of a context, in order of first occurence
+typedef struct
+{
+   HLH_markov_count_array counts;
+   uint32_t total;
+}HLH_markov_starts;
+
+typedef struct
+{
+   HLH_markov_trie_node *data;
+   int32_t data_used;
+   int32_t data_size;
+}HLH_markov_trie_node_array;
+
+//Hash tables
+//Open addressing with linear probing, the slots
+//only store indices (+1, 0 marks empty slots)
+//into a dense array of the entries
+typedef struct
+{
+   HLH_markov_context_char_array contexts;
+   uint32_t *slots;
+   uint32_t slots_size;
+}HLH_markov_context_char_table;
+
+typedef struct
+{
+   HLH_markov_context_word_array contexts;
+   uint32_t *slots;
+   uint32_t slots_size;
+}HLH_markov_context_word_table;
+
+//Interns words, words are stored back to back
+//(zero terminated) in a single buffer, their ids
+//are indices into offsets/hashes
+typedef struct
+{
+   char *data;
+   uint32_t data_used;
+   uint32_t data_size;
+
+   uint32_t *offsets;
+   uint32_t *hashes;
+   uint32_t words_used;
+   uint32_t words_size;
+
+   uint32_t *slots;
+   uint32_t slots_size;
+}HLH_markov_word_table;
+
 typedef struct
 {
-   HLH_markov_char_array start_chars;
-   HLH_markov_context_char_array contexts[256];
+   HLH_markov_starts starts;
+   HLH_markov_context_char_table contexts;
 }HLH_markov_model_char;
 
 typedef struct
 {
-   HLH_markov_str_array words[256];
-   HLH_markov_u32_array start_words;
-   HLH_markov_word_node *root;
+   HLH_markov_word_table words;
+   HLH_markov_starts starts;
+   HLH_markov_context_word_table contexts;
 }HLH_markov_model_word;
 
+//Contexts of every order in a single suffix trie, the path
+//from the root (node 0) to a node is its context, most recent
+//symbol first. Symbols are characters or word ids
+typedef struct
+{
+   uint32_t order;
+   uint32_t order_min;
+   HLH_markov_word_table words;
+   HLH_markov_starts starts;
+   HLH_markov_trie_node_array nodes;
+}HLH_markov_model_trie;
+
 typedef struct
 {
    HLH_markov_model_type type;
+
+   //Set by HLH_markov_model_freeze(), the training
+   //data in 'as' is freed at that point
+   const HLH_markov_frozen *frozen;
+   //frozen is owned by the caller (HLH_markov_model_load_mem())
+   int frozen_borrowed;
+   //Created by HLH_markov_model_new_trie(), uses 'as.mtrie'
+   int trie;
+   //Set by HLH_markov_model_set_budget(), the size is checked once
+   //the size at the last check (budget_size) plus what was allocated
+   //since exceeds the budget, or the amount of contexts reaches
+   //budget_check. budget_grown are the bytes allocated for successors
+   //and starts, budget_contexts the amount of contexts at the last check
+   size_t budget;
+   size_t budget_size;
+   size_t budget_grown;
+   uint64_t budget_contexts;
+   uint64_t budget_check;
    union
    {
       HLH_markov_model_word mword;
       HLH_markov_model_char mchar;
+      HLH_markov_model_trie mtrie;
    }as;
 }HLH_markov_model;
 
+//xoshiro256** state, seed with HLH_markov_rng_seed()
+typedef struct
+{
+   uint64_t s[4];
+}HLH_markov_rng;
+
+//Caller provided output buffer of HLH_markov_model_generate_batch()
+typedef struct
+{
+   char *data;
+   size_t data_used;
+   size_t data_size;
+}HLH_markov_arena;
+
 HLH_markov_model *HLH_markov_model_new(HLH_markov_model_type type);
 void HLH_markov_model_delete(HLH_markov_model *model);
 
-void HLH_markov_model_add(HLH_markov_model *model, const char *str);
+//Model with the order chosen at runtime (up to HLH_MARKOV_ORDER_MAX)
+//instead of HLH_MARKOV_ORDER_*, the contexts are kept in a suffix
+//trie, so contexts share their common parts and backing off while
+//generating walks a single path. Works with all other functions.
+//Returns NULL if the orders are out of range
+HLH_markov_model *HLH_markov_model_new_trie(HLH_markov_model_type type, int order, int order_min);
+
+//Returns 0 on success, -1 if the model is frozen
+int HLH_markov_model_add(HLH_markov_model *model, const char *str);
+
+//Same as calling HLH_markov_model_add() on every sep separated
+//part of str (len bytes, empty parts are skipped) in order.
+//str is split into up to 'threads' shards at separators, which
+//get trained in parallel and merged, the resulting model is
+//identical to one trained sequentially (unless a budget is set).
+//Returns 0 on success, -1 if the model is frozen
+int HLH_markov_model_add_text(HLH_markov_model *model, const char *str, size_t len, char sep, int threads);
+
+//Removes the contexts seen less than min_count times, except for
+//order 1 contexts, which generation backs off to. Longer contexts
+//are seen at most as often as the contexts they extend, so every
+//context that remains can still back off to all shorter ones.
+//Returns 0 on success, -1 if the model is frozen
+int HLH_markov_model_prune(HLH_markov_model *model, uint32_t min_count);
+
+//Keeps the model below budget bytes (see HLH_markov_model_size())
+//while adding strings: once it grows beyond, the contexts seen least
+//often are pruned until the model fits into 3/4 of the budget.
+//Growth is tracked for contexts, their successors and the start
+//symbols, memory for words, hash slots and trie children only
+//shows up at the next check (at the latest once the amount of
+//contexts grew by an eighth). Order 1 contexts are never evicted,
+//they alone can exceed the budget.
+//0 (the default) disables the budget
+void HLH_markov_model_set_budget(HLH_markov_model *model, size_t budget);
+
+//Converts the model into a compact read only form
+//that generates in constant time per character/word,
+//no strings can be added afterwards
+void HLH_markov_model_freeze(HLH_markov_model *model);
+
+//Uses a frozen model saved with HLH_markov_model_save() in place,
+//e.g. a read only mmap()ed file, mem needs to be 8 byte aligned
+//and stay valid until the model is deleted.
+//Only the header is validated, don't load untrusted files.
+//Returns NULL if the model is invalid or was saved with
+//a different version/byte order
+HLH_markov_model *HLH_markov_model_load_mem(const void *mem, size_t size);
+
+#ifdef _HLH_STREAM_H_
+//Model needs to be frozen, the data is written as is (native byte order)
+//Returns 0 on success, -1 otherwise
+int HLH_markov_model_save(const HLH_markov_model *model, HLH_rw *rw);
+
+//Same as HLH_markov_model_load_mem(), but reads into an owned copy
+HLH_markov_model *HLH_markov_model_load(HLH_rw *rw);
+#endif
 
 char *HLH_markov_model_generate(const HLH_markov_model *model);
 
-int HLH_markov_model_size(const HLH_markov_model *model);
+void HLH_markov_rng_seed(HLH_markov_rng *rng, uint64_t seed);
+
+//Generates up to n strings from a frozen model into the arena
+//(after data_used), back to back and each zero terminated.
+//Stops once a string doesn't fit, rng is reset to before that
+//string, so emptying the arena and continuing gives the same
+//strings. A string that doesn't fit into an empty arena is cut off.
+//Neither allocates nor uses global state, any number of threads
+//can generate from the same model (each with its own rng and arena).
+//Returns the amount of strings generated, 0 if the model isn't frozen
+size_t HLH_markov_model_generate_batch(const HLH_markov_model *model, HLH_markov_rng *rng, size_t n, HLH_markov_arena *arena);
+
+//Memory used by the model in bytes
+size_t HLH_markov_model_size(const HLH_markov_model *model);
+
+//Same as HLH_markov_model_size(), but also sets sizes[i] to the memory
+//used by contexts of order i and sizes[0] to the memory shared by all
+//orders (words, hash slots, ...). Orders of sizes_count and above only
+//count towards the total, sizes can be NULL if sizes_count is 0
+size_t HLH_markov_model_size_orders(const HLH_markov_model *model, size_t *sizes, int sizes_count);
 
 #endif
 
@@ -165,97 +347,244 @@ int HLH_markov_model_size(const HLH_markov_model *model);
 #define HLH_MARKOV_MAX_LENGTH 2048
 #endif
 
+//Maximum number of different successors of a character context
+//kept in a sorted (symbol,count) array, contexts with more
+//successors switch to a dense array of 256 counts (at most 255)
+#ifndef HLH_MARKOV_SPARSE_MAX
+#define HLH_MARKOV_SPARSE_MAX 64
+#endif
+
+//Minimum amount of bytes per shard in HLH_markov_model_add_text(),
+//merging costs about as much as training a small shard
+#ifndef HLH_MARKOV_SHARD_MIN
+#define HLH_MARKOV_SHARD_MIN (1<<20)
+#endif
+
+//Highest order of trie and loaded models
+#ifndef HLH_MARKOV_ORDER_MAX
+#define HLH_MARKOV_ORDER_MAX 16
+#endif
+
+#if HLH_MARKOV_ORDER_CHAR>HLH_MARKOV_ORDER_MAX||HLH_MARKOV_ORDER_WORD>HLH_MARKOV_ORDER_MAX
+#error "HLH_MARKOV_ORDER_CHAR/HLH_MARKOV_ORDER_WORD can't exceed HLH_MARKOV_ORDER_MAX"
+#endif
+
+#define HLH_MARKOV_FROZEN_MAGIC ((uint32_t)0x4b4d4c48)
+#define HLH_MARKOV_FROZEN_VERSION 2
+
 #define HLH_FNV_32_PRIME ((uint32_t)0x01000193)
+#define HLH_FNV_64_PRIME ((uint64_t)0x100000001b3)
 
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 
+#ifdef HLH_MARKOV_THREADS
+#include <pthread.h>
+#endif
+
 struct HLH_markov_context_char
 {
+   uint64_t hash;
+
+   //Sorted by symbol while counts_used<=HLH_MARKOV_SPARSE_MAX,
+   //dense (indexed by symbol) afterwards
+   union
+   {
+      HLH_markov_count *sparse;
+      uint32_t *dense;
+   }counts;
+   uint32_t total;
+   uint16_t counts_used;
+   uint16_t counts_size;
+
    char context[HLH_MARKOV_ORDER_CHAR];
    uint8_t context_size;
-   uint32_t total;
-   uint16_t counts[256];
 };
 
-struct HLH_markov_word_node
+struct HLH_markov_context_word
 {
-   //Data
+   uint64_t hash;
    uint32_t context[HLH_MARKOV_ORDER_WORD];
    int32_t context_size;
-   int32_t total;
+   uint32_t total;
    HLH_markov_count_array counts;
+};
 
-   HLH_markov_word_node *left;
-   HLH_markov_word_node *right;
-   int height;
+struct HLH_markov_count
+{
+   uint32_t count;
+   uint32_t item;
 };
 
-struct HLH_markov_char_node
+typedef struct
 {
-   //Data
-   char context[HLH_MARKOV_ORDER_CHAR];
-   int32_t context_size;
-   int32_t total;
-   HLH_markov_count_array counts;
+   uint32_t symbol;
+   uint32_t node;
+}HLH_markov_trie_child;
 
-   HLH_markov_char_node *left;
-   HLH_markov_char_node *right;
-   int height;
+struct HLH_markov_trie_node
+{
+   //Successors, in order of first occurence
+   HLH_markov_count *counts;
+   //Sorted by symbol
+   HLH_markov_trie_child *children;
+
+   //The arrays have room for the next power of
+   //two (at least 2) of their used entries
+   uint32_t total;
+   uint32_t counts_used;
+   uint32_t children_used;
 };
 
-static int32_t _HLH_markov_word_node_cmp(const HLH_markov_word_node * restrict a, const HLH_markov_word_node * restrict b);
-static HLH_markov_word_node *_HLH_markov_word_node_rotl(HLH_markov_word_node *root);
-static HLH_markov_word_node *_HLH_markov_word_node_rotr(HLH_markov_word_node *root);
-static int _HLH_markov_word_node_height(const HLH_markov_word_node *root);
-static HLH_markov_word_node *_HLH_markov_word_node_insert(HLH_markov_word_node *root, HLH_markov_word_node *node, HLH_markov_word_node **insert);
-static int _HLH_markov_word_node_balance(const HLH_markov_word_node *root);
-static HLH_markov_word_node *_HLH_markov_word_node_search(HLH_markov_word_node *root, uint32_t context[HLH_MARKOV_ORDER_WORD], uint32_t context_size);
-static int _HLH_markov_word_node_count(HLH_markov_word_node *root);
+//Frozen models are a single block of memory, everything
+//is referenced by offsets (in bytes) from its start.
+//Both model types store their contexts as arrays of
+//symbols (characters or word ids). The start symbols
+//are an alias table of starts_used entries, starts_total
+//is the amount of strings they were counted in
+struct HLH_markov_frozen
+{
+   uint32_t magic;
+   uint32_t version;
+   uint32_t type;
+   uint32_t order;
+   uint32_t order_min;
+   uint32_t slots_size;
+   uint64_t size;
+
+   uint64_t starts;
+   uint64_t starts_used;
+   uint64_t starts_total;
+   uint64_t slots;
+   uint64_t contexts;
+   uint64_t contexts_used;
+   uint64_t context_size;
+   uint64_t alias;
+   uint64_t alias_used;
+   uint64_t words;
+   uint64_t words_used;
+   uint64_t strings;
+   uint64_t strings_size;
+};
 
-struct HLH_markov_count
+//Followed by the key (order symbols), the size
+//of a context including its key is context_size
+typedef struct
+{
+   uint64_t hash;
+   uint32_t key_size;
+   uint32_t alias;
+   uint32_t alias_count;
+   uint32_t total;
+   uint32_t key[];
+}HLH_markov_frozen_context;
+
+//Walker/Vose alias table entry, item is picked if
+//a random number below the total of the context
+//is less than prob, alias otherwise
+typedef struct
 {
-   uint32_t count;
    uint32_t item;
-};
+   uint32_t alias;
+   uint32_t prob;
+}HLH_markov_alias;
+
+#ifdef HLH_MARKOV_THREADS
+//Part of the input of HLH_markov_model_add_text()
+typedef struct
+{
+   HLH_markov_model *model;
+   const char *str;
+   size_t len;
+   char sep;
+}HLH_markov_shard;
+#endif
 
-static char *_HLH_markov_strtok(char *s, const char *sep);
+static char *_HLH_markov_strtok(char *s, const char *sep, char **src);
 
 static void _HLH_markov_model_delete_char(HLH_markov_model *model);
 static void _HLH_markov_model_delete_word(HLH_markov_model *model);
-
-static void _HLH_markov_model_add_char(HLH_markov_model *model, const char *str);
-static void _HLH_markov_model_add_word(HLH_markov_model *model, const char *str);
+static void _HLH_markov_model_delete_trie(HLH_markov_model *model);
+
+static void _HLH_markov_model_add_char(HLH_markov_model *model, const char *str, size_t len);
+static void _HLH_markov_model_add_word(HLH_markov_model *model, const char *str, size_t len);
+static void _HLH_markov_model_add_trie(HLH_markov_model *model, const char *str, size_t len);
+static void _HLH_markov_model_add_parts(HLH_markov_model *model, const char *str, size_t len, char sep);
+static void _HLH_markov_model_budget(HLH_markov_model *model);
+static uint64_t _HLH_markov_model_contexts(const HLH_markov_model *model);
+static size_t _HLH_markov_model_context_size(const HLH_markov_model *model);
+
+#ifdef HLH_MARKOV_THREADS
+static void *_HLH_markov_shard_train(void *data);
+static void _HLH_markov_model_merge_char(HLH_markov_model *model, const HLH_markov_model *shard);
+static void _HLH_markov_model_merge_word(HLH_markov_model *model, const HLH_markov_model *shard);
+static void _HLH_markov_model_merge_trie(HLH_markov_model *model, const HLH_markov_model *shard);
+#endif
 
 static char *_HLH_markov_model_generate_word(const HLH_markov_model *model);
 static char *_HLH_markov_model_generate_char(const HLH_markov_model *model);
-
-static void _HLH_markov_context_char_array_free(HLH_markov_context_char_array *array);
-static HLH_markov_context_char *_HLH_markov_context_char_find_or_create(HLH_markov_context_char_array *array, char context[HLH_MARKOV_ORDER_CHAR], uint32_t context_size);
-static HLH_markov_context_char *_HLH_markov_context_char_find(const HLH_markov_context_char_array *array, char context[HLH_MARKOV_ORDER_CHAR], uint32_t context_size);
-
-static HLH_markov_word_node *_HLH_markov_context_word_find_or_create(HLH_markov_word_node **root, uint32_t context[HLH_MARKOV_ORDER_WORD], uint32_t context_size);
-static HLH_markov_word_node *_HLH_markov_context_word_find(HLH_markov_word_node *root, uint32_t context[HLH_MARKOV_ORDER_WORD], uint32_t context_size);
+static char *_HLH_markov_model_generate_trie(const HLH_markov_model *model);
+static char *_HLH_markov_model_generate_frozen(const HLH_markov_frozen *frozen);
+static int _HLH_markov_frozen_generate(const HLH_markov_frozen *frozen, HLH_markov_rng *rng, uint32_t *sentence);
+static uint32_t _HLH_markov_frozen_pick(const HLH_markov_alias *alias, uint32_t count, uint32_t total, HLH_markov_rng *rng);
+static size_t _HLH_markov_frozen_write(const HLH_markov_frozen *frozen, const uint32_t *sentence, int sentence_used, char *buffer, size_t buffer_size);
+
+static uint64_t _HLH_markov_rng_next(HLH_markov_rng *rng);
+static uint32_t _HLH_markov_rand(HLH_markov_rng *rng, uint32_t bound);
+
+static uint32_t _HLH_markov_frozen_context_set(HLH_markov_frozen *frozen, uint64_t index, uint32_t entry, const uint32_t *key, uint32_t key_size, const HLH_markov_count *successors, uint32_t count, HLH_markov_count *counts, uint64_t *weights, uint32_t *small, uint32_t *large);
+static void _HLH_markov_frozen_alias(HLH_markov_alias *alias, const HLH_markov_count *counts, uint32_t count, uint64_t *weights, uint32_t *small, uint32_t *large);
+static const HLH_markov_frozen_context *_HLH_markov_frozen_find(const HLH_markov_frozen *frozen, const uint32_t *context, uint32_t context_size);
+static int _HLH_markov_frozen_check(const HLH_markov_frozen *frozen, uint64_t size);
+
+static void _HLH_markov_context_char_table_free(HLH_markov_context_char_table *table);
+static void _HLH_markov_context_char_table_rehash(HLH_markov_context_char_table *table, uint32_t slots_size);
+static void _HLH_markov_context_char_table_prune(HLH_markov_context_char_table *table, uint32_t min_count);
+static HLH_markov_context_char *_HLH_markov_context_char_find_or_create(HLH_markov_context_char_table *table, const char context[HLH_MARKOV_ORDER_CHAR], uint32_t context_size);
+static HLH_markov_context_char *_HLH_markov_context_char_find(const HLH_markov_context_char_table *table, const char context[HLH_MARKOV_ORDER_CHAR], uint32_t context_size);
+static size_t _HLH_markov_context_char_count(HLH_markov_context_char *context, unsigned char symbol, uint32_t count);
+static unsigned char _HLH_markov_context_char_successor(const HLH_markov_context_char *context, uint32_t num, int weighted);
+
+static void _HLH_markov_word_table_free(HLH_markov_word_table *table);
+static void _HLH_markov_word_table_grow(HLH_markov_word_table *table);
+static uint32_t _HLH_markov_word_table_add(HLH_markov_word_table *table, const char *word);
+static void _HLH_markov_word_table_sentence(HLH_markov_word_table *table, const char *str, size_t len, HLH_markov_u32_array *sentence);
+
+static void _HLH_markov_context_word_table_free(HLH_markov_context_word_table *table);
+static void _HLH_markov_context_word_table_rehash(HLH_markov_context_word_table *table, uint32_t slots_size);
+static void _HLH_markov_context_word_table_prune(HLH_markov_context_word_table *table, uint32_t min_count);
+static HLH_markov_context_word *_HLH_markov_context_word_find_or_create(HLH_markov_context_word_table *table, const uint32_t context[HLH_MARKOV_ORDER_WORD], uint32_t context_size);
+static HLH_markov_context_word *_HLH_markov_context_word_find(const HLH_markov_context_word_table *table, const uint32_t context[HLH_MARKOV_ORDER_WORD], uint32_t context_size);
+
+static uint32_t _HLH_markov_trie_find_or_create(HLH_markov_trie_node_array *nodes, uint32_t node, uint32_t symbol);
+static uint32_t _HLH_markov_trie_find(const HLH_markov_trie_node_array *nodes, uint32_t node, uint32_t symbol);
+static size_t _HLH_markov_trie_count(HLH_markov_trie_node *node, uint32_t symbol, uint32_t count);
+static uint32_t _HLH_markov_trie_capacity(uint32_t used);
+static uint32_t _HLH_markov_trie_search(const HLH_markov_trie_node *node, uint32_t symbol);
+static void _HLH_markov_trie_prune(HLH_markov_trie_node_array *nodes, uint32_t min_count);
 
 static const char *_HLH_markov_model_word_get_word(const HLH_markov_model *model, uint32_t word);
-static uint32_t _HLH_markov_model_word_add_word(HLH_markov_model *model, const char *word);
 
-static int _HLH_markov_model_word_size(const HLH_markov_model *model);
-static int _HLH_markov_model_char_size(const HLH_markov_model *model);
+static size_t _HLH_markov_model_word_size(const HLH_markov_model *model, size_t *sizes, int sizes_count);
+static size_t _HLH_markov_model_char_size(const HLH_markov_model *model, size_t *sizes, int sizes_count);
+static size_t _HLH_markov_model_trie_size(const HLH_markov_model *model, size_t *sizes, int sizes_count);
+static size_t _HLH_markov_model_frozen_size(const HLH_markov_frozen *frozen, size_t *sizes, int sizes_count);
+static size_t _HLH_markov_size_add(size_t *sizes, int sizes_count, uint32_t order, size_t size);
 
 //FowlerNollVo Hash
 static uint32_t _HLH_markov_fnv32a(const char *str);
+static uint64_t _HLH_markov_context_char_hash(const char *context, uint32_t context_size);
+static uint64_t _HLH_markov_context_word_hash(const uint32_t *context, uint32_t context_size);
 
 //Dynamic arrays
 static void     _HLH_markov_u32_array_add(HLH_markov_u32_array *array, uint32_t num);
 static void     _HLH_markov_u32_array_free(HLH_markov_u32_array *array);
 static void     _HLH_markov_char_array_add(HLH_markov_char_array *array, char ch);
-static void     _HLH_markov_char_array_free(HLH_markov_char_array *array);
-static uint32_t _HLH_markov_str_array_add(HLH_markov_str_array *array, const char *str);
-static void     _HLH_markov_str_array_free(HLH_markov_str_array *array);
-static void     _HLH_markov_count_array_add(HLH_markov_count_array *array, uint32_t item);
+static size_t   _HLH_markov_count_array_add(HLH_markov_count_array *array, uint32_t item, uint32_t count);
 static void     _HLH_markov_count_array_free(HLH_markov_count_array *array);
+static size_t   _HLH_markov_starts_add(HLH_markov_starts *starts, uint32_t symbol, uint32_t count);
+static uint32_t _HLH_markov_starts_pick(const HLH_markov_starts *starts);
 
 HLH_markov_model *HLH_markov_model_new(HLH_markov_model_type type)
 {
@@ -266,12 +595,39 @@ HLH_markov_model *HLH_markov_model_new(HLH_markov_model_type type)
    return model;
 }
 
+HLH_markov_model *HLH_markov_model_new_trie(HLH_markov_model_type type, int order, int order_min)
+{
+   if(order<1||order>HLH_MARKOV_ORDER_MAX||order_min<1||order_min>order)
+      return NULL;
+
+   HLH_markov_model *model = HLH_markov_model_new(type);
+   model->trie = 1;
+   model->as.mtrie.order = order;
+   model->as.mtrie.order_min = order_min;
+
+   //Root, the empty context
+   HLH_markov_trie_node_array *nodes = &model->as.mtrie.nodes;
+   nodes->data_size = 16;
+   nodes->data = HLH_MARKOV_MALLOC(sizeof(*nodes->data)*nodes->data_size);
+   memset(&nodes->data[0],0,sizeof(nodes->data[0]));
+   nodes->data_used = 1;
+
+   return model;
+}
+
 void HLH_markov_model_delete(HLH_markov_model *model)
 {
    if(model==NULL)
       return;
 
-   if(model->type==HLH_MARKOV_CHAR)
+   if(model->frozen!=NULL)
+   {
+      if(!model->frozen_borrowed)
+         HLH_MARKOV_FREE((void *)model->frozen);
+   }
+   else if(model->trie)
+      _HLH_markov_model_delete_trie(model);
+   else if(model->type==HLH_MARKOV_CHAR)
       _HLH_markov_model_delete_char(model);
    else if(model->type==HLH_MARKOV_WORD)
       _HLH_markov_model_delete_word(model);
@@ -281,292 +637,1339 @@ void HLH_markov_model_delete(HLH_markov_model *model)
 
 static void _HLH_markov_model_delete_char(HLH_markov_model *model)
 {
-   _HLH_markov_char_array_free(&model->as.mchar.start_chars);
-   for(int i = 0;i<256;i++)
-      _HLH_markov_context_char_array_free(&model->as.mchar.contexts[i]);
+   _HLH_markov_count_array_free(&model->as.mchar.starts.counts);
+   _HLH_markov_context_char_table_free(&model->as.mchar.contexts);
 }
 
 static void _HLH_markov_model_delete_word(HLH_markov_model *model)
 {
-   //TODO
-   /*for(int i = 0;i<256;i++)
-      _HLH_markov_str_array_free(&model->as.mword.words[i]);
+   _HLH_markov_word_table_free(&model->as.mword.words);
+   _HLH_markov_count_array_free(&model->as.mword.starts.counts);
 
-   _HLH_markov_u32_array_free(&model->as.mword.start_words);
-   for(int i = 0;i<256;i++)
-   {
-      for(int j = 0;j<model->as.mword.contexts[i].data_used;j++)
-         _HLH_markov_count_array_free(&model->as.mword.contexts[i].data[j].counts);
-      _HLH_markov_context_word_array_free(&model->as.mword.contexts[i]);
-   }*/
+   _HLH_markov_context_word_table_free(&model->as.mword.contexts);
 }
 
-void HLH_markov_model_add(HLH_markov_model *model, const char *str)
+static void _HLH_markov_model_delete_trie(HLH_markov_model *model)
 {
-   if(model->type==HLH_MARKOV_CHAR)
-      _HLH_markov_model_add_char(model,str);
-   else if(model->type==HLH_MARKOV_WORD)
-      _HLH_markov_model_add_word(model,str);
-}
+   HLH_markov_trie_node_array *nodes = &model->as.mtrie.nodes;
+   for(int32_t i = 0;i<nodes->data_used;i++)
+   {
+      if(nodes->data[i].counts!=NULL)
+         HLH_MARKOV_FREE(nodes->data[i].counts);
+      if(nodes->data[i].children!=NULL)
+         HLH_MARKOV_FREE(nodes->data[i].children);
+   }
+   if(nodes->data!=NULL)
+      HLH_MARKOV_FREE(nodes->data);
 
-char *HLH_markov_model_generate(const HLH_markov_model *model)
-{
-   if(model->type==HLH_MARKOV_CHAR)
-      return _HLH_markov_model_generate_char(model);
-   else if(model->type==HLH_MARKOV_WORD)
-      return _HLH_markov_model_generate_word(model);
-   return NULL;
+   _HLH_markov_word_table_free(&model->as.mtrie.words);
+   _HLH_markov_count_array_free(&model->as.mtrie.starts.counts);
 }
 
-int HLH_markov_model_size(const HLH_markov_model *model)
+int HLH_markov_model_add(HLH_markov_model *model, const char *str)
 {
-   if(model->type==HLH_MARKOV_CHAR)
-      return _HLH_markov_model_char_size(model);
+   if(model->frozen!=NULL)
+      return -1;
+
+   if(model->trie)
+      _HLH_markov_model_add_trie(model,str,strlen(str));
+   else if(model->type==HLH_MARKOV_CHAR)
+      _HLH_markov_model_add_char(model,str,strlen(str));
    else if(model->type==HLH_MARKOV_WORD)
-      return _HLH_markov_model_word_size(model);
+      _HLH_markov_model_add_word(model,str,strlen(str));
+   _HLH_markov_model_budget(model);
+
    return 0;
 }
 
-static char *_HLH_markov_model_generate_word(const HLH_markov_model *model)
+int HLH_markov_model_add_text(HLH_markov_model *model, const char *str, size_t len, char sep, int threads)
 {
-   if(model->as.mword.start_words.data_used==0)
-      return NULL;
+   if(model->frozen!=NULL)
+      return -1;
 
-   HLH_markov_u32_array sentence = {0};
-   _HLH_markov_u32_array_add(&sentence,model->as.mword.start_words.data[HLH_MARKOV_RAND()%model->as.mword.start_words.data_used]);
+#ifdef HLH_MARKOV_THREADS
+   int shards = threads;
+   if((uint64_t)shards>len/HLH_MARKOV_SHARD_MIN)
+      shards = len/HLH_MARKOV_SHARD_MIN;
 
-   int done = 0;
-   while(!done)
+   if(shards>1)
    {
-      int start = sentence.data_used;
-
-#if HLH_MARKOV_ORDER_MIN_WORD!=HLH_MARKOV_ORDER_WORD
-      int backoff = HLH_MARKOV_ORDER_MIN_WORD+HLH_MARKOV_RAND()%(HLH_MARKOV_ORDER_WORD-HLH_MARKOV_ORDER_MIN_WORD+1);
-#else
-      int backoff = HLH_MARKOV_ORDER_WORD;
-#endif
-
-      if(start-backoff<0)
-         backoff = start;
-      start--;
-
-      uint32_t context[HLH_MARKOV_ORDER_WORD] = {0};
-      for(int i = 0;i<backoff;i++)
-         context[i] = sentence.data[start-i];
-      
-      HLH_markov_word_node *model_context = NULL;
-      for(int i = backoff;i>0;i--)
+      HLH_markov_shard *shard = HLH_MARKOV_MALLOC(sizeof(*shard)*shards);
+      pthread_t *thread = HLH_MARKOV_MALLOC(sizeof(*thread)*shards);
+      int *started = HLH_MARKOV_MALLOC(sizeof(*started)*shards);
+
+      //Shards end right after a separator, the first
+      //one is trained into the model directly, since
+      //nothing precedes it
+      size_t start = 0;
+      for(int i = 0;i<shards;i++)
       {
-         uint8_t xor = 0;
-         for(int j = 0;j<i;j++)
+         size_t end = len;
+         if(i<shards-1)
          {
-            uint32_t word = sentence.data[start-j];
-
-            xor^=word&255;
-            xor^=(word>>8)&255;
-            xor^=(word>>16)&255;
-            xor^=(word>>24)&255;
+            end = (len/shards)*(i+1);
+            if(end<start)
+               end = start;
+            const char *next = memchr(str+end,sep,len-end);
+            end = next==NULL?len:(size_t)(next-str)+1;
          }
 
-         model_context = _HLH_markov_context_word_find(model->as.mword.root,context,i);
-         if(model_context!=NULL)
-            break;
+         if(i==0)
+            shard[i].model = model;
+         else if(model->trie)
+            shard[i].model = HLH_markov_model_new_trie(model->type,model->as.mtrie.order,model->as.mtrie.order_min);
+         else
+            shard[i].model = HLH_markov_model_new(model->type);
+         //Shards share the budget, the merged model gets pruned again
+         if(i>0)
+            shard[i].model->budget = model->budget/shards;
+         shard[i].str = str+start;
+         shard[i].len = end-start;
+         shard[i].sep = sep;
+         start = end;
       }
 
-      if(model_context!=NULL)
-      {
-#if HLH_MARKOV_RANDOM_WEIGHT
-         uint32_t num = HLH_MARKOV_RAND()%model_context->total;
-         uint32_t cur = 0;
-         for(int i = 0;i<model_context->counts.data_used;i++)
-         {
-            cur+=model_context->counts.data[i].count;
-            if(cur>=num)
-            {
-               _HLH_markov_u32_array_add(&sentence,model_context->counts.data[i].item);
-               break;
-            }
-         }
-#else
-         _HLH_markov_u32_array_add(&sentence,model_context->counts.data[HLH_MARKOV_RAND()%model_context->counts.data_used].item);
-#endif
-      }
-      else
+      for(int i = 1;i<shards;i++)
+         started[i] = pthread_create(&thread[i],NULL,_HLH_markov_shard_train,&shard[i])==0;
+      _HLH_markov_shard_train(&shard[0]);
+
+      //Merge in order, a shard that couldn't
+      //get a thread is trained here instead
+      for(int i = 1;i<shards;i++)
       {
-         done = 1;
+         if(started[i])
+            pthread_join(thread[i],NULL);
+         else
+            _HLH_markov_shard_train(&shard[i]);
+
+         if(model->trie)
+            _HLH_markov_model_merge_trie(model,shard[i].model);
+         else if(model->type==HLH_MARKOV_CHAR)
+            _HLH_markov_model_merge_char(model,shard[i].model);
+         else if(model->type==HLH_MARKOV_WORD)
+            _HLH_markov_model_merge_word(model,shard[i].model);
+         HLH_markov_model_delete(shard[i].model);
+         _HLH_markov_model_budget(model);
       }
 
-      if(sentence.data_used>=HLH_MARKOV_MAX_LENGTH)
-         done = 1;
-   }
+      HLH_MARKOV_FREE(started);
+      HLH_MARKOV_FREE(thread);
+      HLH_MARKOV_FREE(shard);
 
-   HLH_markov_char_array str = {0};
-   for(int i = 0;i<sentence.data_used;i++)
-   {
-      const char *s = _HLH_markov_model_word_get_word(model,sentence.data[i]);
-      for(;*s!='\0';s++)
-         _HLH_markov_char_array_add(&str,*s);
-      _HLH_markov_char_array_add(&str,' ');
+      return 0;
    }
-   _HLH_markov_char_array_add(&str,'\0');
+#else
+   (void)threads;
+#endif
 
-   _HLH_markov_u32_array_free(&sentence);
+   _HLH_markov_model_add_parts(model,str,len,sep);
 
-   return str.data;
+   return 0;
 }
 
-static char *_HLH_markov_model_generate_char(const HLH_markov_model *model)
+void HLH_markov_model_freeze(HLH_markov_model *model)
 {
-   if(model->as.mchar.start_chars.data_used==0)
-      return NULL;
-
-   HLH_markov_char_array str = {0};
-   _HLH_markov_char_array_add(&str,model->as.mchar.start_chars.data[HLH_MARKOV_RAND()%model->as.mchar.start_chars.data_used]);
+   if(model==NULL||model->frozen!=NULL)
+      return;
 
-   int done = 0;
-   while(!done)
+   //Count everything first, the frozen model
+   //is allocated in one piece
+   uint64_t contexts_used = 0;
+   uint64_t alias_used = 0;
+   const HLH_markov_starts *starts = NULL;
+   uint64_t words_used = 0;
+   uint64_t strings_size = 0;
+   uint32_t max_count = 0;
+   uint32_t order = 0;
+   uint32_t order_min = 0;
+   if(model->trie)
    {
-      int start = str.data_used;
-
-#if HLH_MARKOV_ORDER_MIN_CHAR!=HLH_MARKOV_ORDER_CHAR
-      int backoff = HLH_MARKOV_ORDER_MIN_CHAR+HLH_MARKOV_RAND()%(HLH_MARKOV_ORDER_CHAR-HLH_MARKOV_ORDER_MIN_CHAR+1);
-#else
-      int backoff = HLH_MARKOV_ORDER_CHAR;
-#endif
-
-      if(start-backoff<0)
-         backoff = start;
-      start--;
+      const HLH_markov_model_trie *trie = &model->as.mtrie;
+      contexts_used = trie->nodes.data_used-1;
+      for(int32_t i = 1;i<trie->nodes.data_used;i++)
+      {
+         uint32_t count = trie->nodes.data[i].counts_used;
+         alias_used+=count;
+         if(count>max_count)
+            max_count = count;
+      }
+      starts = &trie->starts;
+      if((uint32_t)starts->counts.data_used>max_count)
+         max_count = starts->counts.data_used;
+      if(model->type==HLH_MARKOV_WORD)
+      {
+         words_used = trie->words.words_used;
+         strings_size = trie->words.data_used;
+      }
+      order = trie->order;
+      order_min = trie->order_min;
+   }
+   else if(model->type==HLH_MARKOV_CHAR)
+   {
+      const HLH_markov_context_char_table *table = &model->as.mchar.contexts;
+      contexts_used = table->contexts.data_used;
+      for(int32_t i = 0;i<table->contexts.data_used;i++)
+         alias_used+=table->contexts.data[i].counts_used;
+      starts = &model->as.mchar.starts;
+      max_count = 256;
+      order = HLH_MARKOV_ORDER_CHAR;
+      order_min = HLH_MARKOV_ORDER_MIN_CHAR;
+   }
+   else if(model->type==HLH_MARKOV_WORD)
+   {
+      const HLH_markov_context_word_table *table = &model->as.mword.contexts;
+      contexts_used = table->contexts.data_used;
+      for(int32_t i = 0;i<table->contexts.data_used;i++)
+      {
+         uint32_t count = table->contexts.data[i].counts.data_used;
+         alias_used+=count;
+         if(count>max_count)
+            max_count = count;
+      }
+      starts = &model->as.mword.starts;
+      if((uint32_t)starts->counts.data_used>max_count)
+         max_count = starts->counts.data_used;
+      words_used = model->as.mword.words.words_used;
+      strings_size = model->as.mword.words.data_used;
+      order = HLH_MARKOV_ORDER_WORD;
+      order_min = HLH_MARKOV_ORDER_MIN_WORD;
+   }
 
-      char context[HLH_MARKOV_ORDER_CHAR] = {0};
-      for(int i = 0;i<backoff;i++)
-         context[i] = str.data[start-i];
-      
-      HLH_markov_context_char *model_context = NULL;
-      for(int i = backoff;i>0;i--)
+   uint64_t starts_used = starts==NULL?0:starts->counts.data_used;
+   uint64_t starts_total = starts==NULL?0:starts->total;
+
+   uint64_t context_size = (sizeof(HLH_markov_frozen_context)+sizeof(uint32_t)*order+7)&~(uint64_t)7;
+   uint32_t slots_size = 64;
+   while((uint64_t)slots_size*3<contexts_used*4)
+      slots_size*=2;
+
+   //Layout, every section is aligned to 8 bytes
+   uint64_t size = sizeof(HLH_markov_frozen);
+   uint64_t off_contexts = size;
+   size+=contexts_used*context_size;
+   uint64_t off_alias = size;
+   size+=((alias_used*sizeof(HLH_markov_alias))+7)&~(uint64_t)7;
+   uint64_t off_slots = size;
+   size+=((slots_size*sizeof(uint32_t))+7)&~(uint64_t)7;
+   uint64_t off_starts = size;
+   size+=((starts_used*sizeof(HLH_markov_alias))+7)&~(uint64_t)7;
+   uint64_t off_words = size;
+   size+=((words_used*sizeof(uint32_t))+7)&~(uint64_t)7;
+   uint64_t off_strings = size;
+   size+=(strings_size+7)&~(uint64_t)7;
+
+   HLH_markov_frozen *frozen = HLH_MARKOV_MALLOC(size);
+   memset(frozen,0,size);
+   frozen->magic = HLH_MARKOV_FROZEN_MAGIC;
+   frozen->version = HLH_MARKOV_FROZEN_VERSION;
+   frozen->type = model->type;
+   frozen->order = order;
+   frozen->order_min = order_min;
+   frozen->slots_size = slots_size;
+   frozen->size = size;
+   frozen->starts = off_starts;
+   frozen->starts_used = starts_used;
+   frozen->starts_total = starts_total;
+   frozen->slots = off_slots;
+   frozen->contexts = off_contexts;
+   frozen->contexts_used = contexts_used;
+   frozen->context_size = context_size;
+   frozen->alias = off_alias;
+   frozen->alias_used = alias_used;
+   frozen->words = off_words;
+   frozen->words_used = words_used;
+   frozen->strings = off_strings;
+   frozen->strings_size = strings_size;
+
+   uint8_t *base = (uint8_t *)frozen;
+
+   //Scratch space for building the alias tables
+   HLH_markov_count *counts = HLH_MARKOV_MALLOC(sizeof(*counts)*(max_count+1));
+   uint64_t *weights = HLH_MARKOV_MALLOC(sizeof(*weights)*(max_count+1));
+   uint32_t *small = HLH_MARKOV_MALLOC(sizeof(*small)*(max_count+1));
+   uint32_t *large = HLH_MARKOV_MALLOC(sizeof(*large)*(max_count+1));
+
+   uint32_t entry = 0;
+   if(model->trie)
+   {
+      //Depth first, the key of a node is the path to it
+      const HLH_markov_trie_node_array *nodes = &model->as.mtrie.nodes;
+      uint32_t key[HLH_MARKOV_ORDER_MAX];
+      uint32_t path[HLH_MARKOV_ORDER_MAX+1];
+      uint32_t next[HLH_MARKOV_ORDER_MAX+1];
+      int depth = 0;
+      path[0] = 0;
+      next[0] = 0;
+      uint64_t i = 0;
+      while(depth>=0)
       {
-         uint8_t xor = 0;
-         for(int j = 0;j<i;j++)
+         const HLH_markov_trie_node *node = &nodes->data[path[depth]];
+         if(next[depth]==node->children_used)
          {
-            char ch = str.data[start-j];
-
-            xor^=ch;
+            depth--;
+            continue;
          }
 
-         model_context = _HLH_markov_context_char_find(&model->as.mchar.contexts[xor],context,i);
-         if(model_context!=NULL)
-            break;
-      }
+         const HLH_markov_trie_child *child = &node->children[next[depth]++];
+         const HLH_markov_trie_node *context = &nodes->data[child->node];
+         key[depth] = child->symbol;
+         entry+=_HLH_markov_frozen_context_set(frozen,i++,entry,key,depth+1,context->counts,context->counts_used,counts,weights,small,large);
 
-      if(model_context!=NULL)
+         depth++;
+         path[depth] = child->node;
+         next[depth] = 0;
+      }
+   }
+   else
+   {
+      for(uint64_t i = 0;i<contexts_used;i++)
       {
-#if HLH_MARKOV_RANDOM_WEIGHT
-         uint32_t num = HLH_MARKOV_RAND()%model_context->total;
-         uint32_t cur = 0;
-         for(int i = 0;i<128;i++)
+         uint32_t key[HLH_MARKOV_ORDER_MAX];
+         uint32_t key_size = 0;
+         const HLH_markov_count *successors = counts;
+         uint32_t count = 0;
+         if(model->type==HLH_MARKOV_CHAR)
          {
-            cur+=model_context->counts[i];
-            if(model_context->counts[i]>0&&cur>=num)
+            const HLH_markov_context_char *context = &model->as.mchar.contexts.contexts.data[i];
+            for(int j = 0;j<context->context_size;j++)
+               key[j] = (unsigned char)context->context[j];
+            key_size = context->context_size;
+
+            if(context->counts_used>HLH_MARKOV_SPARSE_MAX)
             {
-               _HLH_markov_char_array_add(&str,(char)i);
-               break;
+               for(int j = 0;j<256;j++)
+               {
+                  if(context->counts.dense[j]==0)
+                     continue;
+                  counts[count].item = j;
+                  counts[count].count = context->counts.dense[j];
+                  count++;
+               }
+            }
+            else
+            {
+               successors = context->counts.sparse;
+               count = context->counts_used;
             }
          }
-#else
-         _HLH_markov_char_array_add(&str,model_context->counts.data[HLH_MARKOV_RAND()%model_context->counts.data_used].item);
-#endif
-      }
-      else
-      {
-         done = 1;
+         else
+         {
+            const HLH_markov_context_word *context = &model->as.mword.contexts.contexts.data[i];
+            memcpy(key,context->context,sizeof(key[0])*context->context_size);
+            key_size = context->context_size;
+            successors = context->counts.data;
+            count = context->counts.data_used;
+         }
+
+         entry+=_HLH_markov_frozen_context_set(frozen,i,entry,key,key_size,successors,count,counts,weights,small,large);
+      }
+   }
+
+   //Starts are weighted by how many strings they started
+   if(starts_used>0)
+      _HLH_markov_frozen_alias((HLH_markov_alias *)(base+off_starts),starts->counts.data,starts_used,weights,small,large);
+
+   HLH_MARKOV_FREE(counts);
+   HLH_MARKOV_FREE(weights);
+   HLH_MARKOV_FREE(small);
+   HLH_MARKOV_FREE(large);
+
+   if(model->trie)
+   {
+      const HLH_markov_word_table *words = &model->as.mtrie.words;
+      if(words_used>0)
+         memcpy(base+off_words,words->offsets,sizeof(words->offsets[0])*words_used);
+      if(strings_size>0)
+         memcpy(base+off_strings,words->data,strings_size);
+      _HLH_markov_model_delete_trie(model);
+   }
+   else if(model->type==HLH_MARKOV_CHAR)
+   {
+      _HLH_markov_model_delete_char(model);
+   }
+   else if(model->type==HLH_MARKOV_WORD)
+   {
+      const HLH_markov_word_table *words = &model->as.mword.words;
+      memcpy(base+off_words,words->offsets,sizeof(words->offsets[0])*words_used);
+      memcpy(base+off_strings,words->data,strings_size);
+      _HLH_markov_model_delete_word(model);
+   }
+
+   memset(&model->as,0,sizeof(model->as));
+   model->frozen = frozen;
+}
+
+HLH_markov_model *HLH_markov_model_load_mem(const void *mem, size_t size)
+{
+   if(mem==NULL||((uintptr_t)mem&7)!=0)
+      return NULL;
+
+   const HLH_markov_frozen *frozen = mem;
+   if(_HLH_markov_frozen_check(frozen,size)!=0)
+      return NULL;
+
+   HLH_markov_model *model = HLH_markov_model_new(frozen->type);
+   model->frozen = frozen;
+   model->frozen_borrowed = 1;
+
+   return model;
+}
+
+#ifdef _HLH_STREAM_H_
+int HLH_markov_model_save(const HLH_markov_model *model, HLH_rw *rw)
+{
+   if(model==NULL||model->frozen==NULL)
+      return -1;
+
+   if(HLH_rw_write(rw,model->frozen,model->frozen->size,1)!=1)
+      return -1;
+
+   return 0;
+}
+
+HLH_markov_model *HLH_markov_model_load(HLH_rw *rw)
+{
+   HLH_markov_frozen header;
+   if(HLH_rw_read(rw,&header,sizeof(header),1)!=1)
+      return NULL;
+
+   //Check the header before allocating anything
+   if(header.magic!=HLH_MARKOV_FROZEN_MAGIC||header.version!=HLH_MARKOV_FROZEN_VERSION)
+      return NULL;
+   if(header.size<=sizeof(header)||header.size>SIZE_MAX)
+      return NULL;
+
+   uint8_t *mem = HLH_MARKOV_MALLOC(header.size);
+   memcpy(mem,&header,sizeof(header));
+   if(HLH_rw_read(rw,mem+sizeof(header),header.size-sizeof(header),1)!=1||_HLH_markov_frozen_check((HLH_markov_frozen *)mem,header.size)!=0)
+   {
+      HLH_MARKOV_FREE(mem);
+      return NULL;
+   }
+
+   HLH_markov_model *model = HLH_markov_model_new(header.type);
+   model->frozen = (HLH_markov_frozen *)mem;
+
+   return model;
+}
+#endif
+
+char *HLH_markov_model_generate(const HLH_markov_model *model)
+{
+   if(model->frozen!=NULL)
+      return _HLH_markov_model_generate_frozen(model->frozen);
+   else if(model->trie)
+      return _HLH_markov_model_generate_trie(model);
+   else if(model->type==HLH_MARKOV_CHAR)
+      return _HLH_markov_model_generate_char(model);
+   else if(model->type==HLH_MARKOV_WORD)
+      return _HLH_markov_model_generate_word(model);
+   return NULL;
+}
+
+void HLH_markov_rng_seed(HLH_markov_rng *rng, uint64_t seed)
+{
+   //splitmix64, so similar seeds give unrelated states
+   for(int i = 0;i<4;i++)
+   {
+      uint64_t z = (seed+=UINT64_C(0x9e3779b97f4a7c15));
+      z = (z^(z>>30))*UINT64_C(0xbf58476d1ce4e5b9);
+      z = (z^(z>>27))*UINT64_C(0x94d049bb133111eb);
+      rng->s[i] = z^(z>>31);
+   }
+}
+
+size_t HLH_markov_model_generate_batch(const HLH_markov_model *model, HLH_markov_rng *rng, size_t n, HLH_markov_arena *arena)
+{
+   const HLH_markov_frozen *frozen = model->frozen;
+   if(frozen==NULL||frozen->starts_used==0)
+      return 0;
+
+   uint32_t sentence[HLH_MARKOV_MAX_LENGTH+1];
+   for(size_t i = 0;i<n;i++)
+   {
+      HLH_markov_rng state = *rng;
+      int sentence_used = _HLH_markov_frozen_generate(frozen,rng,sentence);
+
+      size_t left = arena->data_size-arena->data_used;
+      size_t len = _HLH_markov_frozen_write(frozen,sentence,sentence_used,arena->data+arena->data_used,left);
+      if(len>=left)
+      {
+         if(arena->data_used>0||left==0)
+         {
+            *rng = state;
+            return i;
+         }
+         len = left-1;
+      }
+      arena->data_used+=len+1;
+   }
+
+   return n;
+}
+
+size_t HLH_markov_model_size(const HLH_markov_model *model)
+{
+   return HLH_markov_model_size_orders(model,NULL,0);
+}
+
+size_t HLH_markov_model_size_orders(const HLH_markov_model *model, size_t *sizes, int sizes_count)
+{
+   for(int i = 0;i<sizes_count;i++)
+      sizes[i] = 0;
+
+   if(model->frozen!=NULL)
+      return _HLH_markov_model_frozen_size(model->frozen,sizes,sizes_count);
+   else if(model->trie)
+      return _HLH_markov_model_trie_size(model,sizes,sizes_count);
+   else if(model->type==HLH_MARKOV_CHAR)
+      return _HLH_markov_model_char_size(model,sizes,sizes_count);
+   else if(model->type==HLH_MARKOV_WORD)
+      return _HLH_markov_model_word_size(model,sizes,sizes_count);
+   return 0;
+}
+
+int HLH_markov_model_prune(HLH_markov_model *model, uint32_t min_count)
+{
+   if(model->frozen!=NULL)
+      return -1;
+
+   if(model->trie)
+      _HLH_markov_trie_prune(&model->as.mtrie.nodes,min_count);
+   else if(model->type==HLH_MARKOV_CHAR)
+      _HLH_markov_context_char_table_prune(&model->as.mchar.contexts,min_count);
+   else if(model->type==HLH_MARKOV_WORD)
+      _HLH_markov_context_word_table_prune(&model->as.mword.contexts,min_count);
+
+   return 0;
+}
+
+void HLH_markov_model_set_budget(HLH_markov_model *model, size_t budget)
+{
+   model->budget = budget;
+   model->budget_check = 0;
+   _HLH_markov_model_budget(model);
+}
+
+static char *_HLH_markov_model_generate_word(const HLH_markov_model *model)
+{
+   if(model->as.mword.starts.total==0)
+      return NULL;
+
+   HLH_markov_u32_array sentence = {0};
+   _HLH_markov_u32_array_add(&sentence,_HLH_markov_starts_pick(&model->as.mword.starts));
+
+   int done = 0;
+   while(!done)
+   {
+      int start = sentence.data_used;
+
+#if HLH_MARKOV_ORDER_MIN_WORD!=HLH_MARKOV_ORDER_WORD
+      int backoff = HLH_MARKOV_ORDER_MIN_WORD+HLH_MARKOV_RAND()%(HLH_MARKOV_ORDER_WORD-HLH_MARKOV_ORDER_MIN_WORD+1);
+#else
+      int backoff = HLH_MARKOV_ORDER_WORD;
+#endif
+
+      if(start-backoff<0)
+         backoff = start;
+      start--;
+
+      uint32_t context[HLH_MARKOV_ORDER_WORD] = {0};
+      for(int i = 0;i<backoff;i++)
+         context[i] = sentence.data[start-i];
+      
+      HLH_markov_context_word *model_context = NULL;
+      for(int i = backoff;i>0;i--)
+      {
+         model_context = _HLH_markov_context_word_find(&model->as.mword.contexts,context,i);
+         if(model_context!=NULL)
+            break;
+      }
+
+      if(model_context!=NULL)
+      {
+#if HLH_MARKOV_RANDOM_WEIGHT
+         uint32_t num = HLH_MARKOV_RAND()%model_context->total;
+         uint32_t cur = 0;
+         for(int i = 0;i<model_context->counts.data_used;i++)
+         {
+            cur+=model_context->counts.data[i].count;
+            if(cur>num)
+            {
+               _HLH_markov_u32_array_add(&sentence,model_context->counts.data[i].item);
+               break;
+            }
+         }
+#else
+         _HLH_markov_u32_array_add(&sentence,model_context->counts.data[HLH_MARKOV_RAND()%model_context->counts.data_used].item);
+#endif
+      }
+      else
+      {
+         done = 1;
+      }
+
+      if(sentence.data_used>=HLH_MARKOV_MAX_LENGTH)
+         done = 1;
+   }
+
+   HLH_markov_char_array str = {0};
+   for(int i = 0;i<sentence.data_used;i++)
+   {
+      const char *s = _HLH_markov_model_word_get_word(model,sentence.data[i]);
+      for(;*s!='\0';s++)
+         _HLH_markov_char_array_add(&str,*s);
+      _HLH_markov_char_array_add(&str,' ');
+   }
+   _HLH_markov_char_array_add(&str,'\0');
+
+   _HLH_markov_u32_array_free(&sentence);
+
+   return str.data;
+}
+
+static char *_HLH_markov_model_generate_char(const HLH_markov_model *model)
+{
+   if(model->as.mchar.starts.total==0)
+      return NULL;
+
+   HLH_markov_char_array str = {0};
+   _HLH_markov_char_array_add(&str,(char)_HLH_markov_starts_pick(&model->as.mchar.starts));
+
+   int done = 0;
+   while(!done)
+   {
+      int start = str.data_used;
+
+#if HLH_MARKOV_ORDER_MIN_CHAR!=HLH_MARKOV_ORDER_CHAR
+      int backoff = HLH_MARKOV_ORDER_MIN_CHAR+HLH_MARKOV_RAND()%(HLH_MARKOV_ORDER_CHAR-HLH_MARKOV_ORDER_MIN_CHAR+1);
+#else
+      int backoff = HLH_MARKOV_ORDER_CHAR;
+#endif
+
+      if(start-backoff<0)
+         backoff = start;
+      start--;
+
+      char context[HLH_MARKOV_ORDER_CHAR] = {0};
+      for(int i = 0;i<backoff;i++)
+         context[i] = str.data[start-i];
+      
+      HLH_markov_context_char *model_context = NULL;
+      for(int i = backoff;i>0;i--)
+      {
+         model_context = _HLH_markov_context_char_find(&model->as.mchar.contexts,context,i);
+         if(model_context!=NULL)
+            break;
+      }
+
+      if(model_context!=NULL)
+      {
+#if HLH_MARKOV_RANDOM_WEIGHT
+         _HLH_markov_char_array_add(&str,(char)_HLH_markov_context_char_successor(model_context,HLH_MARKOV_RAND()%model_context->total,1));
+#else
+         _HLH_markov_char_array_add(&str,(char)_HLH_markov_context_char_successor(model_context,HLH_MARKOV_RAND()%model_context->counts_used,0));
+#endif
+      }
+      else
+      {
+         done = 1;
       }
 
       if(str.data_used>=HLH_MARKOV_MAX_LENGTH)
          done = 1;
    }
 
-   _HLH_markov_char_array_add(&str,'\0');
-
-   return str.data;
+   _HLH_markov_char_array_add(&str,'\0');
+
+   return str.data;
+}
+
+static char *_HLH_markov_model_generate_trie(const HLH_markov_model *model)
+{
+   const HLH_markov_model_trie *trie = &model->as.mtrie;
+   if(trie->starts.total==0)
+      return NULL;
+
+   uint32_t sentence[HLH_MARKOV_MAX_LENGTH+1];
+   int sentence_used = 0;
+   sentence[sentence_used++] = _HLH_markov_starts_pick(&trie->starts);
+
+   int done = 0;
+   while(!done)
+   {
+      int start = sentence_used;
+
+      int backoff = trie->order;
+      if(trie->order_min!=trie->order)
+         backoff = trie->order_min+HLH_MARKOV_RAND()%(trie->order-trie->order_min+1);
+
+      if(start-backoff<0)
+         backoff = start;
+
+      //Every context on the path was seen, so the
+      //deepest node is the longest matching context
+      uint32_t node = 0;
+      for(int i = 1;i<=backoff;i++)
+      {
+         uint32_t child = _HLH_markov_trie_find(&trie->nodes,node,sentence[start-i]);
+         if(child==0)
+            break;
+         node = child;
+      }
+
+      if(node!=0)
+      {
+         const HLH_markov_trie_node *model_context = &trie->nodes.data[node];
+#if HLH_MARKOV_RANDOM_WEIGHT
+         uint32_t num = HLH_MARKOV_RAND()%model_context->total;
+         uint32_t cur = 0;
+         for(uint32_t i = 0;i<model_context->counts_used;i++)
+         {
+            cur+=model_context->counts[i].count;
+            if(cur>num)
+            {
+               sentence[sentence_used++] = model_context->counts[i].item;
+               break;
+            }
+         }
+#else
+         sentence[sentence_used++] = model_context->counts[HLH_MARKOV_RAND()%model_context->counts_used].item;
+#endif
+      }
+      else
+      {
+         done = 1;
+      }
+
+      if(sentence_used>=HLH_MARKOV_MAX_LENGTH)
+         done = 1;
+   }
+
+   HLH_markov_char_array str = {0};
+   for(int i = 0;i<sentence_used;i++)
+   {
+      if(model->type==HLH_MARKOV_CHAR)
+      {
+         _HLH_markov_char_array_add(&str,(char)sentence[i]);
+         continue;
+      }
+
+      const char *s = trie->words.data+trie->words.offsets[sentence[i]];
+      for(;*s!='\0';s++)
+         _HLH_markov_char_array_add(&str,*s);
+      _HLH_markov_char_array_add(&str,' ');
+   }
+   _HLH_markov_char_array_add(&str,'\0');
+
+   return str.data;
+}
+
+static char *_HLH_markov_model_generate_frozen(const HLH_markov_frozen *frozen)
+{
+   if(frozen->starts_used==0)
+      return NULL;
+
+   uint32_t sentence[HLH_MARKOV_MAX_LENGTH+1];
+   int sentence_used = _HLH_markov_frozen_generate(frozen,NULL,sentence);
+
+   size_t len = _HLH_markov_frozen_write(frozen,sentence,sentence_used,NULL,0);
+   char *str = HLH_MARKOV_MALLOC(sizeof(*str)*(len+1));
+   _HLH_markov_frozen_write(frozen,sentence,sentence_used,str,len+1);
+
+   return str;
+}
+
+//Generates the symbols of a single string into sentence
+//(at most HLH_MARKOV_MAX_LENGTH+1), returns how many.
+//Draws from rng, or HLH_MARKOV_RAND() if rng is NULL
+static int _HLH_markov_frozen_generate(const HLH_markov_frozen *frozen, HLH_markov_rng *rng, uint32_t *sentence)
+{
+   const uint8_t *base = (const uint8_t *)frozen;
+   const HLH_markov_alias *starts = (const HLH_markov_alias *)(base+frozen->starts);
+   const HLH_markov_alias *alias = (const HLH_markov_alias *)(base+frozen->alias);
+
+   int sentence_used = 0;
+   sentence[sentence_used++] = _HLH_markov_frozen_pick(starts,(uint32_t)frozen->starts_used,(uint32_t)frozen->starts_total,rng);
+
+   int done = 0;
+   while(!done)
+   {
+      int start = sentence_used;
+
+      int backoff = frozen->order;
+      if(frozen->order_min!=frozen->order)
+         backoff = frozen->order_min+_HLH_markov_rand(rng,frozen->order-frozen->order_min+1);
+
+      if(start-backoff<0)
+         backoff = start;
+      start--;
+
+      uint32_t context[HLH_MARKOV_ORDER_MAX] = {0};
+      for(int i = 0;i<backoff;i++)
+         context[i] = sentence[start-i];
+
+      const HLH_markov_frozen_context *model_context = NULL;
+      for(int i = backoff;i>0;i--)
+      {
+         model_context = _HLH_markov_frozen_find(frozen,context,i);
+         if(model_context!=NULL)
+            break;
+      }
+
+      if(model_context!=NULL)
+      {
+         sentence[sentence_used++] = _HLH_markov_frozen_pick(&alias[model_context->alias],model_context->alias_count,model_context->total,rng);
+      }
+      else
+      {
+         done = 1;
+      }
+
+      if(sentence_used>=HLH_MARKOV_MAX_LENGTH)
+         done = 1;
+   }
+
+   return sentence_used;
+}
+
+//Draws from an alias table of count entries
+static uint32_t _HLH_markov_frozen_pick(const HLH_markov_alias *alias, uint32_t count, uint32_t total, HLH_markov_rng *rng)
+{
+   //Many contexts only have a single successor,
+   //no need to draw random numbers for those
+   if(count>1)
+      alias+=_HLH_markov_rand(rng,count);
+   if(alias->prob==total||_HLH_markov_rand(rng,total)<alias->prob)
+      return alias->item;
+   return alias->alias;
+}
+
+//Converts a sentence to text, like snprintf() at most
+//buffer_size-1 characters and the terminating zero are
+//written, returns the length of the whole text
+static size_t _HLH_markov_frozen_write(const HLH_markov_frozen *frozen, const uint32_t *sentence, int sentence_used, char *buffer, size_t buffer_size)
+{
+   size_t len = 0;
+
+   if(frozen->type==HLH_MARKOV_CHAR)
+   {
+      //Strings end with a zero symbol
+      for(int i = 0;i<sentence_used&&sentence[i]!=0;i++,len++)
+      {
+         if(len+1<buffer_size)
+            buffer[len] = (char)sentence[i];
+      }
+   }
+   else
+   {
+      const uint8_t *base = (const uint8_t *)frozen;
+      const uint32_t *words = (const uint32_t *)(base+frozen->words);
+      const char *strings = (const char *)(base+frozen->strings);
+      for(int i = 0;i<sentence_used;i++)
+      {
+         for(const char *w = strings+words[sentence[i]];;w++,len++)
+         {
+            char c = *w=='\0'?' ':*w;
+            if(len+1<buffer_size)
+               buffer[len] = c;
+            if(*w=='\0')
+            {
+               len++;
+               break;
+            }
+         }
+      }
+   }
+
+   if(buffer_size>0)
+      buffer[len<buffer_size?len:buffer_size-1] = '\0';
+
+   return len;
+}
+
+//Fills in context 'index' of a frozen model and its alias table
+//(starting at alias entry 'entry'), counts, weights, small and
+//large are scratch space for at least count successors.
+//Returns the amount of alias entries used
+static uint32_t _HLH_markov_frozen_context_set(HLH_markov_frozen *frozen, uint64_t index, uint32_t entry, const uint32_t *key, uint32_t key_size, const HLH_markov_count *successors, uint32_t count, HLH_markov_count *counts, uint64_t *weights, uint32_t *small, uint32_t *large)
+{
+   uint8_t *base = (uint8_t *)frozen;
+   HLH_markov_frozen_context *c = (HLH_markov_frozen_context *)(base+frozen->contexts+index*frozen->context_size);
+   HLH_markov_alias *alias = (HLH_markov_alias *)(base+frozen->alias);
+   uint32_t *slots = (uint32_t *)(base+frozen->slots);
+
+   memcpy(c->key,key,sizeof(c->key[0])*key_size);
+   c->key_size = key_size;
+   c->alias = entry;
+   c->alias_count = count;
+   c->hash = _HLH_markov_context_word_hash(c->key,c->key_size);
+
+#if HLH_MARKOV_RANDOM_WEIGHT
+   (void)counts;
+   c->total = 0;
+   for(uint32_t j = 0;j<count;j++)
+      c->total+=successors[j].count;
+#else
+   //Every successor has the same weight
+   if(successors!=counts)
+      memcpy(counts,successors,sizeof(*counts)*count);
+   for(uint32_t j = 0;j<count;j++)
+      counts[j].count = 1;
+   successors = counts;
+   c->total = count;
+#endif
+   _HLH_markov_frozen_alias(&alias[entry],successors,count,weights,small,large);
+
+   uint32_t slot = c->hash&(frozen->slots_size-1);
+   while(slots[slot]!=0)
+      slot = (slot+1)&(frozen->slots_size-1);
+   slots[slot] = index+1;
+
+   return count;
+}
+
+//Builds the alias table of a context, weights are scaled by
+//the amount of successors, so all probabilities are integers
+//below the total of the counts
+static void _HLH_markov_frozen_alias(HLH_markov_alias *alias, const HLH_markov_count *counts, uint32_t count, uint64_t *weights, uint32_t *small, uint32_t *large)
+{
+   uint64_t total = 0;
+   for(uint32_t i = 0;i<count;i++)
+      total+=counts[i].count;
+
+   uint32_t small_used = 0;
+   uint32_t large_used = 0;
+   for(uint32_t i = 0;i<count;i++)
+   {
+      alias[i].item = counts[i].item;
+      alias[i].alias = counts[i].item;
+      weights[i] = (uint64_t)counts[i].count*count;
+      if(weights[i]<total)
+         small[small_used++] = i;
+      else
+         large[large_used++] = i;
+   }
+
+   while(small_used>0&&large_used>0)
+   {
+      uint32_t l = small[--small_used];
+      uint32_t g = large[--large_used];
+
+      alias[l].prob = weights[l];
+      alias[l].alias = counts[g].item;
+
+      weights[g] = weights[g]+weights[l]-total;
+      if(weights[g]<total)
+         small[small_used++] = g;
+      else
+         large[large_used++] = g;
+   }
+
+   while(large_used>0)
+      alias[large[--large_used]].prob = total;
+   while(small_used>0)
+      alias[small[--small_used]].prob = total;
+}
+
+static const HLH_markov_frozen_context *_HLH_markov_frozen_find(const HLH_markov_frozen *frozen, const uint32_t *context, uint32_t context_size)
+{
+   const uint8_t *base = (const uint8_t *)frozen;
+   const uint32_t *slots = (const uint32_t *)(base+frozen->slots);
+
+   uint64_t hash = _HLH_markov_context_word_hash(context,context_size);
+   uint32_t mask = frozen->slots_size-1;
+   for(uint32_t slot = hash&mask;slots[slot]!=0;slot = (slot+1)&mask)
+   {
+      const HLH_markov_frozen_context *c = (const HLH_markov_frozen_context *)(base+frozen->contexts+(slots[slot]-1)*frozen->context_size);
+      if(c->hash==hash&&c->key_size==context_size&&memcmp(c->key,context,sizeof(context[0])*context_size)==0)
+         return c;
+   }
+
+   return NULL;
+}
+
+//Makes sure the header matches this implementation and
+//all sections lie within the model, returns 0 if valid
+static int _HLH_markov_frozen_check(const HLH_markov_frozen *frozen, uint64_t size)
+{
+   if(size<sizeof(*frozen))
+      return -1;
+
+   //A model saved on a machine with a different byte
+   //order has the magic number reversed
+   if(frozen->magic!=HLH_MARKOV_FROZEN_MAGIC||frozen->version!=HLH_MARKOV_FROZEN_VERSION||frozen->size!=size)
+      return -1;
+
+   //The orders are stored, they don't need to match HLH_MARKOV_ORDER_*
+   uint32_t order = frozen->order;
+   if(frozen->type!=HLH_MARKOV_CHAR&&frozen->type!=HLH_MARKOV_WORD)
+      return -1;
+   if(order<1||order>HLH_MARKOV_ORDER_MAX||frozen->order_min<1||frozen->order_min>order)
+      return -1;
+
+   //Lookups need at least one empty slot to terminate
+   if(frozen->slots_size==0||(frozen->slots_size&(frozen->slots_size-1))!=0||frozen->slots_size<=frozen->contexts_used)
+      return -1;
+   if(frozen->context_size<sizeof(HLH_markov_frozen_context)+sizeof(uint32_t)*order||(frozen->context_size&7)!=0)
+      return -1;
+
+   //Every start was counted at least once
+   if(frozen->starts_total>UINT32_MAX||frozen->starts_used>frozen->starts_total)
+      return -1;
+
+   const uint64_t sections[][3] = 
+   {
+      {frozen->starts,frozen->starts_used,sizeof(HLH_markov_alias)},
+      {frozen->slots,frozen->slots_size,sizeof(uint32_t)},
+      {frozen->contexts,frozen->contexts_used,frozen->context_size},
+      {frozen->alias,frozen->alias_used,sizeof(HLH_markov_alias)},
+      {frozen->words,frozen->words_used,sizeof(uint32_t)},
+      {frozen->strings,frozen->strings_size,1},
+   };
+   for(int i = 0;i<(int)(sizeof(sections)/sizeof(sections[0]));i++)
+   {
+      uint64_t offset = sections[i][0];
+      uint64_t count = sections[i][1];
+      uint64_t elem = sections[i][2];
+      if((offset&7)!=0||offset<sizeof(*frozen)||offset>size||count>(size-offset)/elem)
+         return -1;
+   }
+
+   return 0;
+}
+
+//The terminating zero of str is implied, str[len] is not read
+static void _HLH_markov_model_add_char(HLH_markov_model *model, const char *str, size_t len)
+{
+   model->budget_grown+=_HLH_markov_starts_add(&model->as.mchar.starts,len>0?(unsigned char)str[0]:0,1);
+   for(size_t i = 1;i<=len;i++)
+   {
+
+      char context[HLH_MARKOV_ORDER_CHAR] = {0};
+      char event = i<len?str[i]:'\0';
+
+      for(int m = 1;m<=HLH_MARKOV_ORDER_CHAR;m++)
+      {
+         if((size_t)m>i)
+            break;
+
+         context[m-1] = str[i-m];
+
+         HLH_markov_context_char *model_context = _HLH_markov_context_char_find_or_create(&model->as.mchar.contexts,context,m);
+
+         //Cap
+         if(model_context->total<UINT32_MAX)
+            model->budget_grown+=_HLH_markov_context_char_count(model_context,(unsigned char)event,1);
+      }
+   }
+}
+
+static void _HLH_markov_model_add_word(HLH_markov_model *model, const char *str, size_t len)
+{
+   HLH_markov_u32_array sentence = {0};
+   _HLH_markov_word_table_sentence(&model->as.mword.words,str,len,&sentence);
+   if(sentence.data_used>0)
+      model->budget_grown+=_HLH_markov_starts_add(&model->as.mword.starts,sentence.data[0],1);
+
+   //Analyze sentence
+   for(int i = 1;i<sentence.data_used;i++)
+   {
+      uint32_t context[HLH_MARKOV_ORDER_WORD] = {0};
+      uint32_t event = sentence.data[i];
+
+      for(int m = 1;m<=HLH_MARKOV_ORDER_WORD;m++)
+      {
+         if((int)i-m<0)
+            break;
+
+         context[m-1] = sentence.data[i-m];
+
+         HLH_markov_context_word *model_context = _HLH_markov_context_word_find_or_create(&model->as.mword.contexts,context,m);
+
+         //Cap
+         if(model_context->total<UINT32_MAX)
+         {
+            model_context->total++;
+            model->budget_grown+=_HLH_markov_count_array_add(&model_context->counts,event,1);
+         }
+      }
+   }
+
+   _HLH_markov_u32_array_free(&sentence);
 }
 
-static void _HLH_markov_model_add_char(HLH_markov_model *model, const char *str)
+//Walks down the trie once per symbol, counting the
+//symbol in every context (order 1 to order) on the way
+static void _HLH_markov_model_add_trie(HLH_markov_model *model, const char *str, size_t len)
 {
-   int len = strlen(str)+1;
+   HLH_markov_model_trie *trie = &model->as.mtrie;
+   HLH_markov_u32_array sentence = {0};
 
-   _HLH_markov_char_array_add(&model->as.mchar.start_chars,str[0]);
-   for(int i = 1;i<len;i++)
+   if(model->type==HLH_MARKOV_CHAR)
+   {
+      //The terminating zero is the last symbol
+      for(size_t i = 0;i<len;i++)
+         _HLH_markov_u32_array_add(&sentence,(unsigned char)str[i]);
+      _HLH_markov_u32_array_add(&sentence,0);
+   }
+   else
    {
+      _HLH_markov_word_table_sentence(&trie->words,str,len,&sentence);
+   }
 
-      char context[HLH_MARKOV_ORDER_CHAR] = {0};
-      char event = str[i];
+   if(sentence.data_used>0)
+      model->budget_grown+=_HLH_markov_starts_add(&trie->starts,sentence.data[0],1);
 
-      uint8_t xor = 0;
-      for(int m = 1;m<=HLH_MARKOV_ORDER_CHAR;m++)
+   for(int32_t i = 1;i<sentence.data_used;i++)
+   {
+      uint32_t node = 0;
+      for(int32_t m = 1;m<=(int32_t)trie->order&&m<=i;m++)
       {
-         if(i-m<0)
-            break;
+         node = _HLH_markov_trie_find_or_create(&trie->nodes,node,sentence.data[i-m]);
 
-         context[m-1] = str[i-m];
-         xor^=context[m-1];
+         //Cap
+         if(trie->nodes.data[node].total<UINT32_MAX)
+            model->budget_grown+=_HLH_markov_trie_count(&trie->nodes.data[node],sentence.data[i],1);
+      }
+   }
+
+   _HLH_markov_u32_array_free(&sentence);
+}
 
-         HLH_markov_context_char *model_context = _HLH_markov_context_char_find_or_create(&model->as.mchar.contexts[xor],context,m);
+static void _HLH_markov_model_add_parts(HLH_markov_model *model, const char *str, size_t len, char sep)
+{
+   const char *end = str+len;
+   while(str<end)
+   {
+      const char *part_end = memchr(str,sep,end-str);
+      if(part_end==NULL)
+         part_end = end;
 
-         //Cap
-         if(model_context->counts[(unsigned char)event]<UINT16_MAX)
-         {
-            model_context->counts[(unsigned char)event]++;
-            model_context->total++;
-         }
+      if(part_end>str)
+      {
+         if(model->trie)
+            _HLH_markov_model_add_trie(model,str,part_end-str);
+         else if(model->type==HLH_MARKOV_CHAR)
+            _HLH_markov_model_add_char(model,str,part_end-str);
+         else if(model->type==HLH_MARKOV_WORD)
+            _HLH_markov_model_add_word(model,str,part_end-str);
+         _HLH_markov_model_budget(model);
       }
+
+      str = part_end+1;
    }
 }
 
-static void _HLH_markov_model_add_word(HLH_markov_model *model, const char *str)
+//Computing the size walks all contexts, so it's only done once
+//the estimate exceeds the budget, or the amount of contexts grew
+//by an eighth since the last check (for the memory not tracked)
+static void _HLH_markov_model_budget(HLH_markov_model *model)
 {
-   char *str_line = HLH_MARKOV_MALLOC(sizeof(*str_line)*(strlen(str)+1));
-   strcpy(str_line,str);
-   HLH_markov_u32_array sentence = {0};
+   if(model->budget==0||model->frozen!=NULL)
+      return;
 
-   //Collect words and convert sentence to integers
-   const char *token = " ";
-   char *word = _HLH_markov_strtok(str_line,token);
-   int first = 1;
-   while(word!=NULL)
+   //Tracked growth is never more than the actual growth, so an
+   //estimate over the budget means the model needs pruning
+   uint64_t contexts = _HLH_markov_model_contexts(model);
+   size_t estimate = model->budget_size+model->budget_grown;
+   if(contexts>model->budget_contexts)
+      estimate+=(contexts-model->budget_contexts)*_HLH_markov_model_context_size(model);
+
+   //Still over the budget after the last check (only order 1 contexts
+   //left), wait for an eighth more instead of checking every string
+   size_t limit = model->budget;
+   if(model->budget_size>limit)
+      limit = model->budget_size+model->budget_size/8;
+   if(estimate<=limit&&contexts<model->budget_check)
+      return;
+
+   //Evict the least seen contexts first, pruning to 3/4 of
+   //the budget leaves room until the next check is due.
+   //Stops early if only order 1 contexts are left
+   size_t sizes[2];
+   size_t size = HLH_markov_model_size_orders(model,sizes,2);
+   if(size>model->budget)
    {
-      uint32_t word_index = _HLH_markov_model_word_add_word(model,word);
-      _HLH_markov_u32_array_add(&sentence,word_index);
-      if(first)
+      for(uint32_t min_count = 2;min_count!=0&&size>model->budget/4*3&&size>sizes[0]+sizes[1];min_count*=2)
       {
-         first = 0;
-         _HLH_markov_u32_array_add(&model->as.mword.start_words,word_index);
+         HLH_markov_model_prune(model,min_count);
+         size = HLH_markov_model_size_orders(model,sizes,2);
       }
+      contexts = _HLH_markov_model_contexts(model);
+   }
+
+   model->budget_size = size;
+   model->budget_grown = 0;
+   model->budget_contexts = contexts;
+   model->budget_check = contexts+contexts/8+1024;
+}
+
+static uint64_t _HLH_markov_model_contexts(const HLH_markov_model *model)
+{
+   if(model->trie)
+      return model->as.mtrie.nodes.data_used;
+   else if(model->type==HLH_MARKOV_CHAR)
+      return model->as.mchar.contexts.contexts.data_used;
+   else if(model->type==HLH_MARKOV_WORD)
+      return model->as.mword.contexts.contexts.data_used;
+   return 0;
+}
+
+//Bytes a new context adds at least, the arrays of trie children
+//grow in steps and aren't tracked, like the hash slots
+static size_t _HLH_markov_model_context_size(const HLH_markov_model *model)
+{
+   if(model->trie)
+      return sizeof(HLH_markov_trie_node);
+   else if(model->type==HLH_MARKOV_CHAR)
+      return sizeof(HLH_markov_context_char);
+   else if(model->type==HLH_MARKOV_WORD)
+      return sizeof(HLH_markov_context_word);
+   return 0;
+}
+
+#ifdef HLH_MARKOV_THREADS
+static void *_HLH_markov_shard_train(void *data)
+{
+   HLH_markov_shard *shard = data;
+   _HLH_markov_model_add_parts(shard->model,shard->str,shard->len,shard->sep);
+
+   return NULL;
+}
+
+//The merges walk the shard in the order it was trained in,
+//so new contexts, words and successors end up in the same
+//order as if the shards text had been added to model directly
+static void _HLH_markov_model_merge_char(HLH_markov_model *model, const HLH_markov_model *shard)
+{
+   const HLH_markov_count_array *starts = &shard->as.mchar.starts.counts;
+   for(int32_t i = 0;i<starts->data_used;i++)
+      model->budget_grown+=_HLH_markov_starts_add(&model->as.mchar.starts,starts->data[i].item,starts->data[i].count);
+
+   const HLH_markov_context_char_array *contexts = &shard->as.mchar.contexts.contexts;
+   for(int32_t i = 0;i<contexts->data_used;i++)
+   {
+      const HLH_markov_context_char *c = &contexts->data[i];
+      HLH_markov_context_char *model_context = _HLH_markov_context_char_find_or_create(&model->as.mchar.contexts,c->context,c->context_size);
+
+      int dense = c->counts_used>HLH_MARKOV_SPARSE_MAX;
+      for(int j = 0;j<(dense?256:c->counts_used);j++)
+      {
+         unsigned char symbol = dense?(uint32_t)j:c->counts.sparse[j].item;
+         uint32_t count = dense?c->counts.dense[j]:c->counts.sparse[j].count;
 
-      word = _HLH_markov_strtok(NULL,token);
+         //Cap
+         if(count>UINT32_MAX-model_context->total)
+            count = UINT32_MAX-model_context->total;
+         if(count>0)
+            model->budget_grown+=_HLH_markov_context_char_count(model_context,symbol,count);
+      }
    }
-   free(str_line);
+}
 
-   //Analyze sentence
-   for(int i = 1;i<sentence.data_used;i++)
+static void _HLH_markov_model_merge_word(HLH_markov_model *model, const HLH_markov_model *shard)
+{
+   //Word ids of the shard --> word ids of the model
+   const HLH_markov_word_table *words = &shard->as.mword.words;
+   uint32_t *ids = HLH_MARKOV_MALLOC(sizeof(*ids)*(words->words_used+1));
+   for(uint32_t i = 0;i<words->words_used;i++)
+      ids[i] = _HLH_markov_word_table_add(&model->as.mword.words,words->data+words->offsets[i]);
+
+   const HLH_markov_count_array *starts = &shard->as.mword.starts.counts;
+   for(int32_t i = 0;i<starts->data_used;i++)
+      model->budget_grown+=_HLH_markov_starts_add(&model->as.mword.starts,ids[starts->data[i].item],starts->data[i].count);
+
+   const HLH_markov_context_word_array *contexts = &shard->as.mword.contexts.contexts;
+   for(int32_t i = 0;i<contexts->data_used;i++)
    {
+      const HLH_markov_context_word *c = &contexts->data[i];
       uint32_t context[HLH_MARKOV_ORDER_WORD] = {0};
-      uint32_t event = sentence.data[i];
+      for(int j = 0;j<c->context_size;j++)
+         context[j] = ids[c->context[j]];
 
-      for(int m = 1;m<=HLH_MARKOV_ORDER_WORD;m++)
+      HLH_markov_context_word *model_context = _HLH_markov_context_word_find_or_create(&model->as.mword.contexts,context,c->context_size);
+      for(int32_t j = 0;j<c->counts.data_used;j++)
       {
-         if((int)i-m<0)
-            break;
+         uint32_t count = c->counts.data[j].count;
 
-         context[m-1] = sentence.data[i-m];
+         //Cap
+         if(count>UINT32_MAX-model_context->total)
+            count = UINT32_MAX-model_context->total;
+         if(count>0)
+         {
+            model_context->total+=count;
+            model->budget_grown+=_HLH_markov_count_array_add(&model_context->counts,ids[c->counts.data[j].item],count);
+         }
+      }
+   }
+
+   HLH_MARKOV_FREE(ids);
+}
+
+static void _HLH_markov_model_merge_trie(HLH_markov_model *model, const HLH_markov_model *shard)
+{
+   HLH_markov_model_trie *trie = &model->as.mtrie;
+   const HLH_markov_model_trie *from = &shard->as.mtrie;
+
+   //Word ids of the shard --> word ids of the model,
+   //characters are the same in both
+   uint32_t *ids = NULL;
+   if(model->type==HLH_MARKOV_WORD)
+   {
+      ids = HLH_MARKOV_MALLOC(sizeof(*ids)*(from->words.words_used+1));
+      for(uint32_t i = 0;i<from->words.words_used;i++)
+         ids[i] = _HLH_markov_word_table_add(&trie->words,from->words.data+from->words.offsets[i]);
+   }
+
+   const HLH_markov_count_array *starts = &from->starts.counts;
+   for(int32_t i = 0;i<starts->data_used;i++)
+      model->budget_grown+=_HLH_markov_starts_add(&trie->starts,ids==NULL?starts->data[i].item:ids[starts->data[i].item],starts->data[i].count);
+
+   //Walk both tries at once, depth first
+   uint32_t path[HLH_MARKOV_ORDER_MAX+1];
+   uint32_t path_model[HLH_MARKOV_ORDER_MAX+1];
+   uint32_t next[HLH_MARKOV_ORDER_MAX+1];
+   int depth = 0;
+   path[0] = 0;
+   path_model[0] = 0;
+   next[0] = 0;
+   while(depth>=0)
+   {
+      const HLH_markov_trie_node *node = &from->nodes.data[path[depth]];
+      if(next[depth]==node->children_used)
+      {
+         depth--;
+         continue;
+      }
+
+      const HLH_markov_trie_child *child = &node->children[next[depth]++];
+      uint32_t symbol = ids==NULL?child->symbol:ids[child->symbol];
+      uint32_t target = _HLH_markov_trie_find_or_create(&trie->nodes,path_model[depth],symbol);
 
-         HLH_markov_word_node *model_context = _HLH_markov_context_word_find_or_create(&model->as.mword.root,context,m);
-         model_context->total++;
-         _HLH_markov_count_array_add(&model_context->counts,event);
+      const HLH_markov_trie_node *n = &from->nodes.data[child->node];
+      HLH_markov_trie_node *t = &trie->nodes.data[target];
+      for(uint32_t j = 0;j<n->counts_used;j++)
+      {
+         uint32_t count = n->counts[j].count;
+
+         //Cap
+         if(count>UINT32_MAX-t->total)
+            count = UINT32_MAX-t->total;
+         if(count>0)
+            model->budget_grown+=_HLH_markov_trie_count(t,ids==NULL?n->counts[j].item:ids[n->counts[j].item],count);
       }
+
+      depth++;
+      path[depth] = child->node;
+      path_model[depth] = target;
+      next[depth] = 0;
    }
 
-   _HLH_markov_u32_array_free(&sentence);
+   if(ids!=NULL)
+      HLH_MARKOV_FREE(ids);
 }
+#endif
 
 static void _HLH_markov_u32_array_add(HLH_markov_u32_array *array, uint32_t num)
 {
@@ -586,153 +1989,533 @@ static void _HLH_markov_u32_array_add(HLH_markov_u32_array *array, uint32_t num)
    }
 }
 
-static void _HLH_markov_u32_array_free(HLH_markov_u32_array *array)
-{
-   if(array==NULL||array->data==NULL)
-      return;
+static void _HLH_markov_u32_array_free(HLH_markov_u32_array *array)
+{
+   if(array==NULL||array->data==NULL)
+      return;
+
+   HLH_MARKOV_FREE(array->data);
+   array->data = NULL;
+   array->data_used = 0;
+   array->data_size = 0;
+}
+
+static void _HLH_markov_char_array_add(HLH_markov_char_array *array, char ch)
+{
+   if(array->data==NULL)
+   {
+      array->data_used = 0;
+      array->data_size = 16;
+      array->data = HLH_MARKOV_MALLOC(sizeof(*array->data)*array->data_size);
+   }
+
+   array->data[array->data_used++] = ch;
+
+   if(array->data_used>=array->data_size)
+   {
+      array->data_size+=16;
+      array->data = HLH_MARKOV_REALLOC(array->data,sizeof(*array->data)*array->data_size);
+   }
+}
+
+static const char *_HLH_markov_model_word_get_word(const HLH_markov_model *model, uint32_t word)
+{
+   return model->as.mword.words.data+model->as.mword.words.offsets[word];
+}
+
+//Returns the amount of bytes allocated
+static size_t _HLH_markov_count_array_add(HLH_markov_count_array *array, uint32_t item, uint32_t count)
+{
+   size_t grown = 0;
+   if(array->data==NULL)
+   {
+      array->data_used = 0;
+      array->data_size = 16;
+      array->data = HLH_MARKOV_MALLOC(sizeof(*array->data)*array->data_size);
+      grown+=sizeof(*array->data)*array->data_size;
+   }
+
+   for(int i = 0;i<array->data_used;i++)
+   {
+      if(array->data[i].item==item)
+      {
+         array->data[i].count+=count;
+         return grown;
+      }
+   }
+
+   array->data[array->data_used].item = item;
+   array->data[array->data_used].count = count;
+   array->data_used++;
+
+   if(array->data_used>=array->data_size)
+   {
+      array->data_size+=16;
+      array->data = HLH_MARKOV_REALLOC(array->data,sizeof(*array->data)*array->data_size);
+      grown+=sizeof(*array->data)*16;
+   }
+
+   return grown;
+}
+
+static void _HLH_markov_count_array_free(HLH_markov_count_array *array)
+{
+   if(array==NULL||array->data==NULL)
+      return;
+
+   HLH_MARKOV_FREE(array->data);
+   array->data = NULL;
+   array->data_used = 0;
+   array->data_size = 0;
+}
+
+//Counts symbol as the start of count strings,
+//returns the amount of bytes allocated
+static size_t _HLH_markov_starts_add(HLH_markov_starts *starts, uint32_t symbol, uint32_t count)
+{
+   //Cap
+   if(count>UINT32_MAX-starts->total)
+      count = UINT32_MAX-starts->total;
+   if(count==0)
+      return 0;
+
+   starts->total+=count;
+   return _HLH_markov_count_array_add(&starts->counts,symbol,count);
+}
+
+//Weighted by how many strings started with each symbol
+static uint32_t _HLH_markov_starts_pick(const HLH_markov_starts *starts)
+{
+   uint32_t num = HLH_MARKOV_RAND()%starts->total;
+   uint32_t cur = 0;
+   for(int32_t i = 0;i<starts->counts.data_used;i++)
+   {
+      cur+=starts->counts.data[i].count;
+      if(cur>num)
+         return starts->counts.data[i].item;
+   }
+
+   return starts->counts.data[starts->counts.data_used-1].item;
+}
+
+static void _HLH_markov_context_char_table_free(HLH_markov_context_char_table *table)
+{
+   if(table==NULL)
+      return;
+
+   for(int32_t i = 0;i<table->contexts.data_used;i++)
+   {
+      //Both members of the union are the same allocation
+      if(table->contexts.data[i].counts.sparse!=NULL)
+         HLH_MARKOV_FREE(table->contexts.data[i].counts.sparse);
+   }
+
+   if(table->contexts.data!=NULL)
+      HLH_MARKOV_FREE(table->contexts.data);
+   if(table->slots!=NULL)
+      HLH_MARKOV_FREE(table->slots);
+   memset(table,0,sizeof(*table));
+}
+
+//Doubles the amount of slots and reinserts all contexts,
+//the dense array of contexts stays as is
+//slots_size needs to be a power of two
+static void _HLH_markov_context_char_table_rehash(HLH_markov_context_char_table *table, uint32_t slots_size)
+{
+   if(table->slots!=NULL)
+      HLH_MARKOV_FREE(table->slots);
+
+   table->slots_size = slots_size;
+   table->slots = HLH_MARKOV_MALLOC(sizeof(*table->slots)*table->slots_size);
+   memset(table->slots,0,sizeof(*table->slots)*table->slots_size);
+
+   uint32_t mask = table->slots_size-1;
+   for(int32_t i = 0;i<table->contexts.data_used;i++)
+   {
+      uint32_t slot = table->contexts.data[i].hash&mask;
+      while(table->slots[slot]!=0)
+         slot = (slot+1)&mask;
+      table->slots[slot] = i+1;
+   }
+}
+
+//Removes the contexts of order 2 and up seen less than min_count
+//times, the dense array stays in order and the memory is given back
+static void _HLH_markov_context_char_table_prune(HLH_markov_context_char_table *table, uint32_t min_count)
+{
+   HLH_markov_context_char_array *array = &table->contexts;
+   int32_t used = 0;
+   for(int32_t i = 0;i<array->data_used;i++)
+   {
+      HLH_markov_context_char *c = &array->data[i];
+      if(c->context_size>1&&c->total<min_count)
+      {
+         if(c->counts.sparse!=NULL)
+            HLH_MARKOV_FREE(c->counts.sparse);
+         continue;
+      }
+
+      array->data[used++] = *c;
+   }
+
+   if(used==array->data_used)
+      return;
+   array->data_used = used;
+
+   int32_t data_size = 16;
+   while(data_size<=used)
+      data_size*=2;
+   if(data_size<array->data_size)
+   {
+      array->data_size = data_size;
+      array->data = HLH_MARKOV_REALLOC(array->data,sizeof(*array->data)*array->data_size);
+   }
+
+   uint32_t slots_size = 64;
+   while(((uint64_t)used+1)*4>(uint64_t)slots_size*3)
+      slots_size*=2;
+   _HLH_markov_context_char_table_rehash(table,slots_size);
+}
+
+static HLH_markov_context_char *_HLH_markov_context_char_find_or_create(HLH_markov_context_char_table *table, const char context[HLH_MARKOV_ORDER_CHAR], uint32_t context_size)
+{
+   //Keep the load factor below 3/4
+   if(((uint64_t)table->contexts.data_used+1)*4>(uint64_t)table->slots_size*3)
+      _HLH_markov_context_char_table_rehash(table,table->slots_size==0?64:table->slots_size*2);
+
+   uint64_t hash = _HLH_markov_context_char_hash(context,context_size);
+   uint32_t mask = table->slots_size-1;
+   uint32_t slot = hash&mask;
+   for(;table->slots[slot]!=0;slot = (slot+1)&mask)
+   {
+      HLH_markov_context_char *c = &table->contexts.data[table->slots[slot]-1];
+      if(c->hash==hash&&c->context_size==context_size&&memcmp(c->context,context,sizeof(context[0])*context_size)==0)
+         return c;
+   }
+
+   HLH_markov_context_char_array *array = &table->contexts;
+   if(array->data==NULL)
+   {
+      array->data_used = 0;
+      array->data_size = 16;
+      array->data = HLH_MARKOV_MALLOC(sizeof(*array->data)*array->data_size);
+   }
+
+   HLH_markov_context_char *c = &array->data[array->data_used];
+   c->hash = hash;
+   memcpy(c->context,context,sizeof(context[0])*context_size);
+   c->context_size = context_size;
+   c->total = 0;
+   c->counts.sparse = NULL;
+   c->counts_used = 0;
+   c->counts_size = 0;
+   array->data_used++;
+   table->slots[slot] = array->data_used;
+
+   if(array->data_used>=array->data_size)
+   {
+      array->data_size*=2;
+      array->data = HLH_MARKOV_REALLOC(array->data,sizeof(*array->data)*array->data_size);
+   }
+   
+   return &array->data[array->data_used-1];
+}
+
+static HLH_markov_context_char *_HLH_markov_context_char_find(const HLH_markov_context_char_table *table, const char context[HLH_MARKOV_ORDER_CHAR], uint32_t context_size)
+{
+   if(table->slots==NULL)
+      return NULL;
+
+   uint64_t hash = _HLH_markov_context_char_hash(context,context_size);
+   uint32_t mask = table->slots_size-1;
+   for(uint32_t slot = hash&mask;table->slots[slot]!=0;slot = (slot+1)&mask)
+   {
+      HLH_markov_context_char *c = &table->contexts.data[table->slots[slot]-1];
+      if(c->hash==hash&&c->context_size==context_size&&memcmp(c->context,context,sizeof(context[0])*context_size)==0)
+         return c;
+   }
+
+   return NULL;
+}
+
+static size_t _HLH_markov_context_char_count(HLH_markov_context_char *context, unsigned char symbol, uint32_t count)
+{
+   context->total+=count;
+
+   if(context->counts_used>HLH_MARKOV_SPARSE_MAX)
+   {
+      if(context->counts.dense[symbol]==0)
+         context->counts_used++;
+      context->counts.dense[symbol]+=count;
+      return 0;
+   }
+
+   //Find symbol or insertion point
+   HLH_markov_count *sparse = context->counts.sparse;
+   int i = 0;
+   for(;i<context->counts_used&&sparse[i].item<symbol;i++);
+   if(i<context->counts_used&&sparse[i].item==symbol)
+   {
+      sparse[i].count+=count;
+      return 0;
+   }
+
+   //Too many successors, switch to dense array
+   if(context->counts_used==HLH_MARKOV_SPARSE_MAX)
+   {
+      uint32_t *dense = HLH_MARKOV_MALLOC(sizeof(*dense)*256);
+      memset(dense,0,sizeof(*dense)*256);
+      for(int j = 0;j<context->counts_used;j++)
+         dense[sparse[j].item] = sparse[j].count;
+      dense[symbol] = count;
+      HLH_MARKOV_FREE(sparse);
+
+      size_t grown = sizeof(*dense)*256-sizeof(*sparse)*context->counts_size;
+      context->counts.dense = dense;
+      context->counts_used++;
+      context->counts_size = 256;
+      return grown;
+   }
+
+   size_t grown = 0;
+   if(context->counts_used==context->counts_size)
+   {
+      grown = sizeof(*sparse)*context->counts_size;
+      context->counts_size = context->counts_size==0?4:context->counts_size*2;
+      if(context->counts_size>HLH_MARKOV_SPARSE_MAX)
+         context->counts_size = HLH_MARKOV_SPARSE_MAX;
+      sparse = HLH_MARKOV_REALLOC(sparse,sizeof(*sparse)*context->counts_size);
+      context->counts.sparse = sparse;
+      grown = sizeof(*sparse)*context->counts_size-grown;
+   }
+
+   memmove(&sparse[i+1],&sparse[i],sizeof(*sparse)*(context->counts_used-i));
+   sparse[i].item = symbol;
+   sparse[i].count = count;
+   context->counts_used++;
 
-   HLH_MARKOV_FREE(array->data);
-   array->data = NULL;
-   array->data_used = 0;
-   array->data_size = 0;
+   return grown;
 }
 
-static void _HLH_markov_char_array_add(HLH_markov_char_array *array, char ch)
+//Returns the successor num falls on, either weighted by
+//count (num<total) or the num-th successor (num<counts_used)
+static unsigned char _HLH_markov_context_char_successor(const HLH_markov_context_char *context, uint32_t num, int weighted)
 {
-   if(array->data==NULL)
-   {
-      array->data_used = 0;
-      array->data_size = 16;
-      array->data = HLH_MARKOV_MALLOC(sizeof(*array->data)*array->data_size);
-   }
+   uint32_t cur = 0;
 
-   array->data[array->data_used++] = ch;
+   if(context->counts_used>HLH_MARKOV_SPARSE_MAX)
+   {
+      for(int i = 0;i<256;i++)
+      {
+         if(context->counts.dense[i]==0)
+            continue;
 
-   if(array->data_used>=array->data_size)
+         cur+=weighted?context->counts.dense[i]:1;
+         if(cur>num)
+            return (unsigned char)i;
+      }
+   }
+   else
    {
-      array->data_size+=16;
-      array->data = HLH_MARKOV_REALLOC(array->data,sizeof(*array->data)*array->data_size);
+      for(int i = 0;i<context->counts_used;i++)
+      {
+         cur+=weighted?context->counts.sparse[i].count:1;
+         if(cur>num)
+            return (unsigned char)context->counts.sparse[i].item;
+      }
    }
+
+   //Not reached, num is always below the sum
+   return 0;
 }
 
-static void _HLH_markov_char_array_free(HLH_markov_char_array *array)
+static void _HLH_markov_word_table_free(HLH_markov_word_table *table)
 {
-   if(array==NULL||array->data==NULL)
+   if(table==NULL)
       return;
 
-   HLH_MARKOV_FREE(array->data);
-   array->data = NULL;
-   array->data_used = 0;
-   array->data_size = 0;
+   if(table->data!=NULL)
+      HLH_MARKOV_FREE(table->data);
+   if(table->offsets!=NULL)
+      HLH_MARKOV_FREE(table->offsets);
+   if(table->hashes!=NULL)
+      HLH_MARKOV_FREE(table->hashes);
+   if(table->slots!=NULL)
+      HLH_MARKOV_FREE(table->slots);
+   memset(table,0,sizeof(*table));
 }
 
-static uint32_t _HLH_markov_model_word_add_word(HLH_markov_model *model, const char *word)
+//Doubles the amount of slots and reinserts all words
+static void _HLH_markov_word_table_grow(HLH_markov_word_table *table)
 {
-   uint8_t index = _HLH_markov_fnv32a(word)&255;
-   return _HLH_markov_str_array_add(&model->as.mword.words[index],word)|(index<<24);
-}
+   if(table->slots!=NULL)
+      HLH_MARKOV_FREE(table->slots);
 
-static const char *_HLH_markov_model_word_get_word(const HLH_markov_model *model, uint32_t word)
-{
-   uint8_t index = (word>>24)&255;
-   word^=(index<<24);
-   return model->as.mword.words[index].data[word];
+   table->slots_size = table->slots_size==0?64:table->slots_size*2;
+   table->slots = HLH_MARKOV_MALLOC(sizeof(*table->slots)*table->slots_size);
+   memset(table->slots,0,sizeof(*table->slots)*table->slots_size);
+
+   uint32_t mask = table->slots_size-1;
+   for(uint32_t i = 0;i<table->words_used;i++)
+   {
+      uint32_t slot = table->hashes[i]&mask;
+      while(table->slots[slot]!=0)
+         slot = (slot+1)&mask;
+      table->slots[slot] = i+1;
+   }
 }
 
-static uint32_t _HLH_markov_str_array_add(HLH_markov_str_array *array, const char *str)
+static uint32_t _HLH_markov_word_table_add(HLH_markov_word_table *table, const char *word)
 {
-   if(array->data==NULL)
+   //Keep the load factor below 3/4
+   if(((uint64_t)table->words_used+1)*4>(uint64_t)table->slots_size*3)
+      _HLH_markov_word_table_grow(table);
+
+   uint32_t hash = _HLH_markov_fnv32a(word);
+   uint32_t mask = table->slots_size-1;
+   uint32_t slot = hash&mask;
+   for(;table->slots[slot]!=0;slot = (slot+1)&mask)
    {
-      array->data_used = 0;
-      array->data_size = 16;
-      array->data = HLH_MARKOV_MALLOC(sizeof(*array->data)*array->data_size);
+      uint32_t id = table->slots[slot]-1;
+      if(table->hashes[id]==hash&&strcmp(table->data+table->offsets[id],word)==0)
+         return id;
    }
 
-   for(int i = 0;i<array->data_used;i++)
-      if(strcmp(array->data[i],str)==0)
-         return i;
+   uint32_t len = strlen(word)+1;
+   if(table->data_used+len>table->data_size)
+   {
+      if(table->data_size==0)
+         table->data_size = 1024;
+      while(table->data_used+len>table->data_size)
+         table->data_size*=2;
+      table->data = HLH_MARKOV_REALLOC(table->data,sizeof(*table->data)*table->data_size);
+   }
 
-   int len = strlen(str)+1;
-   array->data[array->data_used] = HLH_MARKOV_MALLOC(sizeof(*array->data[array->data_used])*len);
-   strcpy(array->data[array->data_used],str);
-   array->data_used++;
+   if(table->words_used==table->words_size)
+   {
+      table->words_size = table->words_size==0?64:table->words_size*2;
+      table->offsets = HLH_MARKOV_REALLOC(table->offsets,sizeof(*table->offsets)*table->words_size);
+      table->hashes = HLH_MARKOV_REALLOC(table->hashes,sizeof(*table->hashes)*table->words_size);
+   }
 
-   if(array->data_used>=array->data_size)
+   memcpy(table->data+table->data_used,word,len);
+   table->offsets[table->words_used] = table->data_used;
+   table->hashes[table->words_used] = hash;
+   table->data_used+=len;
+   table->words_used++;
+   table->slots[slot] = table->words_used;
+
+   return table->words_used-1;
+}
+
+//Splits str (len bytes) at spaces, interns the
+//words and appends their ids to sentence
+static void _HLH_markov_word_table_sentence(HLH_markov_word_table *table, const char *str, size_t len, HLH_markov_u32_array *sentence)
+{
+   char *str_line = HLH_MARKOV_MALLOC(sizeof(*str_line)*(len+1));
+   memcpy(str_line,str,len);
+   str_line[len] = '\0';
+
+   const char *token = " ";
+   char *src = NULL;
+   char *word = _HLH_markov_strtok(str_line,token,&src);
+   while(word!=NULL)
    {
-      array->data_size+=16;
-      array->data = HLH_MARKOV_REALLOC(array->data,sizeof(*array->data)*array->data_size);
+      _HLH_markov_u32_array_add(sentence,_HLH_markov_word_table_add(table,word));
+      word = _HLH_markov_strtok(NULL,token,&src);
    }
-   
-   return array->data_used-1;
+
+   HLH_MARKOV_FREE(str_line);
 }
 
-static void _HLH_markov_str_array_free(HLH_markov_str_array *array)
+static void _HLH_markov_context_word_table_free(HLH_markov_context_word_table *table)
 {
-   if(array==NULL||array->data==NULL)
+   if(table==NULL)
       return;
 
-   for(int i = 0;i<array->data_used;i++)
-      HLH_MARKOV_FREE(array->data[i]);
+   for(int32_t i = 0;i<table->contexts.data_used;i++)
+      _HLH_markov_count_array_free(&table->contexts.data[i].counts);
 
-   HLH_MARKOV_FREE(array->data);
-   array->data = NULL;
-   array->data_used = 0;
-   array->data_size = 0;
+   if(table->contexts.data!=NULL)
+      HLH_MARKOV_FREE(table->contexts.data);
+   if(table->slots!=NULL)
+      HLH_MARKOV_FREE(table->slots);
+   memset(table,0,sizeof(*table));
 }
 
-static void _HLH_markov_count_array_add(HLH_markov_count_array *array, uint32_t item)
+//Same as _HLH_markov_context_char_table_rehash
+static void _HLH_markov_context_word_table_rehash(HLH_markov_context_word_table *table, uint32_t slots_size)
 {
-   if(array->data==NULL)
+   if(table->slots!=NULL)
+      HLH_MARKOV_FREE(table->slots);
+
+   table->slots_size = slots_size;
+   table->slots = HLH_MARKOV_MALLOC(sizeof(*table->slots)*table->slots_size);
+   memset(table->slots,0,sizeof(*table->slots)*table->slots_size);
+
+   uint32_t mask = table->slots_size-1;
+   for(int32_t i = 0;i<table->contexts.data_used;i++)
    {
-      array->data_used = 0;
-      array->data_size = 16;
-      array->data = HLH_MARKOV_MALLOC(sizeof(*array->data)*array->data_size);
+      uint32_t slot = table->contexts.data[i].hash&mask;
+      while(table->slots[slot]!=0)
+         slot = (slot+1)&mask;
+      table->slots[slot] = i+1;
    }
+}
 
-   for(int i = 0;i<array->data_used;i++)
+//Same as _HLH_markov_context_char_table_prune
+static void _HLH_markov_context_word_table_prune(HLH_markov_context_word_table *table, uint32_t min_count)
+{
+   HLH_markov_context_word_array *array = &table->contexts;
+   int32_t used = 0;
+   for(int32_t i = 0;i<array->data_used;i++)
    {
-      if(array->data[i].item==item)
+      HLH_markov_context_word *c = &array->data[i];
+      if(c->context_size>1&&c->total<min_count)
       {
-         array->data[i].count++;
-         return;
+         _HLH_markov_count_array_free(&c->counts);
+         continue;
       }
+
+      array->data[used++] = *c;
    }
 
-   array->data[array->data_used].item = item;
-   array->data[array->data_used].count = 1;
-   array->data_used++;
+   if(used==array->data_used)
+      return;
+   array->data_used = used;
 
-   if(array->data_used>=array->data_size)
+   int32_t data_size = 16;
+   while(data_size<=used)
+      data_size*=2;
+   if(data_size<array->data_size)
    {
-      array->data_size+=16;
+      array->data_size = data_size;
       array->data = HLH_MARKOV_REALLOC(array->data,sizeof(*array->data)*array->data_size);
    }
-}
-
-static void _HLH_markov_count_array_free(HLH_markov_count_array *array)
-{
-   if(array==NULL||array->data==NULL)
-      return;
 
-   HLH_MARKOV_FREE(array->data);
-   array->data = NULL;
-   array->data_used = 0;
-   array->data_size = 0;
+   uint32_t slots_size = 64;
+   while(((uint64_t)used+1)*4>(uint64_t)slots_size*3)
+      slots_size*=2;
+   _HLH_markov_context_word_table_rehash(table,slots_size);
 }
 
-static void _HLH_markov_context_char_array_free(HLH_markov_context_char_array *array)
+static HLH_markov_context_word *_HLH_markov_context_word_find_or_create(HLH_markov_context_word_table *table, const uint32_t context[HLH_MARKOV_ORDER_WORD], uint32_t context_size)
 {
-   if(array==NULL||array->data==NULL)
-      return;
-
-   HLH_MARKOV_FREE(array->data);
-   array->data = NULL;
-   array->data_used = 0;
-   array->data_size = 0;
-}
+   //Keep the load factor below 3/4
+   if(((uint64_t)table->contexts.data_used+1)*4>(uint64_t)table->slots_size*3)
+      _HLH_markov_context_word_table_rehash(table,table->slots_size==0?64:table->slots_size*2);
+
+   uint64_t hash = _HLH_markov_context_word_hash(context,context_size);
+   uint32_t mask = table->slots_size-1;
+   uint32_t slot = hash&mask;
+   for(;table->slots[slot]!=0;slot = (slot+1)&mask)
+   {
+      HLH_markov_context_word *c = &table->contexts.data[table->slots[slot]-1];
+      if(c->hash==hash&&c->context_size==(int32_t)context_size&&memcmp(c->context,context,sizeof(context[0])*context_size)==0)
+         return c;
+   }
 
-static HLH_markov_context_char *_HLH_markov_context_char_find_or_create(HLH_markov_context_char_array *array, char context[HLH_MARKOV_ORDER_CHAR], uint32_t context_size)
-{
+   HLH_markov_context_word_array *array = &table->contexts;
    if(array->data==NULL)
    {
       array->data_used = 0;
@@ -740,270 +2523,421 @@ static HLH_markov_context_char *_HLH_markov_context_char_find_or_create(HLH_mark
       array->data = HLH_MARKOV_MALLOC(sizeof(*array->data)*array->data_size);
    }
 
-   for(int i = 0;i<array->data_used;i++)
-   {
-      if(array->data[i].context_size!=context_size)
-         continue;
-      if(memcmp(array->data[i].context,context,sizeof(context[0])*context_size)==0)
-         return &array->data[i];
-   }
-
-   memcpy(array->data[array->data_used].context,context,sizeof(context[0])*context_size);
-   array->data[array->data_used].context_size = context_size;
-   array->data[array->data_used].total = 0;
-   memset(&array->data[array->data_used].counts,0,sizeof(array->data[array->data_used].counts));
+   HLH_markov_context_word *c = &array->data[array->data_used];
+   memset(c,0,sizeof(*c));
+   c->hash = hash;
+   memcpy(c->context,context,sizeof(context[0])*context_size);
+   c->context_size = context_size;
    array->data_used++;
+   table->slots[slot] = array->data_used;
 
    if(array->data_used>=array->data_size)
    {
-      array->data_size+=16;
+      array->data_size*=2;
       array->data = HLH_MARKOV_REALLOC(array->data,sizeof(*array->data)*array->data_size);
    }
    
    return &array->data[array->data_used-1];
 }
 
-static HLH_markov_context_char *_HLH_markov_context_char_find(const HLH_markov_context_char_array *array, char context[HLH_MARKOV_ORDER_CHAR], uint32_t context_size)
+static HLH_markov_context_word *_HLH_markov_context_word_find(const HLH_markov_context_word_table *table, const uint32_t context[HLH_MARKOV_ORDER_WORD], uint32_t context_size)
 {
-   if(array->data==NULL)
+   if(table->slots==NULL)
       return NULL;
 
-   for(int i = 0;i<array->data_used;i++)
+   uint64_t hash = _HLH_markov_context_word_hash(context,context_size);
+   uint32_t mask = table->slots_size-1;
+   for(uint32_t slot = hash&mask;table->slots[slot]!=0;slot = (slot+1)&mask)
    {
-      if(array->data[i].context_size!=context_size)
-         continue;
-      if(memcmp(array->data[i].context,context,sizeof(context[0])*context_size)==0)
-         return &array->data[i];
+      HLH_markov_context_word *c = &table->contexts.data[table->slots[slot]-1];
+      if(c->hash==hash&&c->context_size==(int32_t)context_size&&memcmp(c->context,context,sizeof(context[0])*context_size)==0)
+         return c;
    }
 
    return NULL;
 }
 
-static HLH_markov_word_node *_HLH_markov_context_word_find_or_create(HLH_markov_word_node **root, uint32_t context[HLH_MARKOV_ORDER_WORD], uint32_t context_size)
+//Returns the child of node with the given symbol (all node
+//indices, 0 is the root), created if it doesn't exist yet
+static uint32_t _HLH_markov_trie_find_or_create(HLH_markov_trie_node_array *nodes, uint32_t node, uint32_t symbol)
 {
-   HLH_markov_word_node *n;
-   HLH_markov_word_node new = {0};
-   memcpy(&new.context,context,sizeof(*context)*context_size);
-   new.context_size = context_size;
-   new.total = 0;
-   memset(&new.counts,0,sizeof(new.counts));
+   HLH_markov_trie_node *n = &nodes->data[node];
 
-   *root = _HLH_markov_word_node_insert(*root,&new,&n);
-   return n;
-}
+   //Find symbol or insertion point
+   uint32_t low = _HLH_markov_trie_search(n,symbol);
+   if(low<n->children_used&&n->children[low].symbol==symbol)
+      return n->children[low].node;
 
-static HLH_markov_word_node *_HLH_markov_context_word_find(HLH_markov_word_node *root, uint32_t context[HLH_MARKOV_ORDER_WORD], uint32_t context_size)
-{
-   return _HLH_markov_word_node_search(root,context,context_size);
+   if(nodes->data_used==nodes->data_size)
+   {
+      nodes->data_size*=2;
+      nodes->data = HLH_MARKOV_REALLOC(nodes->data,sizeof(*nodes->data)*nodes->data_size);
+      n = &nodes->data[node];
+   }
+   uint32_t child = nodes->data_used++;
+   memset(&nodes->data[child],0,sizeof(nodes->data[child]));
+
+   if(n->children_used==_HLH_markov_trie_capacity(n->children_used))
+      n->children = HLH_MARKOV_REALLOC(n->children,sizeof(*n->children)*_HLH_markov_trie_capacity(n->children_used+1));
+   memmove(&n->children[low+1],&n->children[low],sizeof(*n->children)*(n->children_used-low));
+   n->children[low].symbol = symbol;
+   n->children[low].node = child;
+   n->children_used++;
+
+   return child;
 }
 
-static int _HLH_markov_model_word_size(const HLH_markov_model *model)
+//Returns 0 if node has no child with the given symbol
+static uint32_t _HLH_markov_trie_find(const HLH_markov_trie_node_array *nodes, uint32_t node, uint32_t symbol)
 {
+   const HLH_markov_trie_node *n = &nodes->data[node];
+
+   uint32_t low = _HLH_markov_trie_search(n,symbol);
+   if(low<n->children_used&&n->children[low].symbol==symbol)
+      return n->children[low].node;
+
    return 0;
 }
 
-static int _HLH_markov_model_char_size(const HLH_markov_model *model)
+static size_t _HLH_markov_trie_count(HLH_markov_trie_node *node, uint32_t symbol, uint32_t count)
 {
-   int size = 0;
-   for(int i = 0;i<256;i++)
-      size+=model->as.mchar.contexts[i].data_used*sizeof(model->as.mchar.contexts[i].data[0]);
-   return size;
+   node->total+=count;
+
+   for(uint32_t i = 0;i<node->counts_used;i++)
+   {
+      if(node->counts[i].item==symbol)
+      {
+         node->counts[i].count+=count;
+         return 0;
+      }
+   }
+
+   size_t grown = 0;
+   if(node->counts_used==_HLH_markov_trie_capacity(node->counts_used))
+   {
+      node->counts = HLH_MARKOV_REALLOC(node->counts,sizeof(*node->counts)*_HLH_markov_trie_capacity(node->counts_used+1));
+      grown = sizeof(*node->counts)*(_HLH_markov_trie_capacity(node->counts_used+1)-node->counts_used);
+   }
+   node->counts[node->counts_used].item = symbol;
+   node->counts[node->counts_used].count = count;
+   node->counts_used++;
+
+   return grown;
 }
 
-static uint32_t _HLH_markov_fnv32a(const char *str)
+//Binary search, returns the index of the first child
+//with a symbol not less than symbol. Written without
+//branches on the comparison, since those are unpredictable
+static uint32_t _HLH_markov_trie_search(const HLH_markov_trie_node *node, uint32_t symbol)
 {
-   uint32_t hval = 0x811c9dc5;
-   unsigned char *s = (unsigned char *)str;
-   while(*s) 
+   if(node->children_used==0)
+      return 0;
+
+   const HLH_markov_trie_child *base = node->children;
+   uint32_t len = node->children_used;
+   while(len>1)
    {
-      hval^=(uint32_t)*s++;
-      hval *= HLH_FNV_32_PRIME;
+      uint32_t half = len/2;
+      base = base[half-1].symbol<symbol?base+half:base;
+      len-=half;
    }
 
-   return hval;
+   return (uint32_t)(base-node->children)+(base->symbol<symbol);
 }
 
-static char *_HLH_markov_strtok(char *s, const char *sep)
+static uint32_t _HLH_markov_trie_capacity(uint32_t used)
 {
-   static char *src = NULL;
-   char *p;
+   if(used==0)
+      return 0;
 
-   if(s==NULL)
-      s = src;
+   uint32_t capacity = 2;
+   while(capacity<used)
+      capacity*=2;
 
-   while(*s&&strchr(sep,*s)!=NULL)
-      s++;
+   return capacity;
+}
 
-   if(!*s)
-      return NULL;
+//Removes the nodes below the first level seen less than min_count
+//times along with their subtrees. Children always come after their
+//parents in the node array, so a single pass in order decides for
+//every node and the kept ones can be moved down in place
+static void _HLH_markov_trie_prune(HLH_markov_trie_node_array *nodes, uint32_t min_count)
+{
+   //New index of every node, UINT32_MAX if removed
+   uint32_t *remap = HLH_MARKOV_MALLOC(sizeof(*remap)*nodes->data_used);
+   uint32_t used = 0;
+   remap[0] = 0;
+   for(int32_t i = 0;i<nodes->data_used;i++)
+   {
+      const HLH_markov_trie_node *node = &nodes->data[i];
+      int keep = remap[i]!=UINT32_MAX;
+      if(keep)
+         remap[i] = used++;
 
-   for(p = s;*s&&!strchr(sep,*s);s++);
+      for(uint32_t j = 0;j<node->children_used;j++)
+      {
+         uint32_t child = node->children[j].node;
+         remap[child] = (keep&&(i==0||nodes->data[child].total>=min_count))?0:UINT32_MAX;
+      }
+   }
 
-   if(*s&&s[1])
-      *(s++) = 0;
+   if(used==(uint32_t)nodes->data_used)
+   {
+      HLH_MARKOV_FREE(remap);
+      return;
+   }
 
-   src = s;
+   for(int32_t i = 0;i<nodes->data_used;i++)
+   {
+      HLH_markov_trie_node *node = &nodes->data[i];
+      if(remap[i]==UINT32_MAX)
+      {
+         if(node->counts!=NULL)
+            HLH_MARKOV_FREE(node->counts);
+         if(node->children!=NULL)
+            HLH_MARKOV_FREE(node->children);
+         continue;
+      }
 
-   return p;
-}
+      uint32_t children_used = 0;
+      for(uint32_t j = 0;j<node->children_used;j++)
+      {
+         if(remap[node->children[j].node]==UINT32_MAX)
+            continue;
+         node->children[children_used].symbol = node->children[j].symbol;
+         node->children[children_used].node = remap[node->children[j].node];
+         children_used++;
+      }
 
-static int32_t _HLH_markov_word_node_cmp(const HLH_markov_word_node * restrict a, const HLH_markov_word_node * restrict b)
-{
-   if(a->context_size!=b->context_size)
-      return a->context_size<b->context_size?-1:1;
+      if(children_used==0&&node->children!=NULL)
+      {
+         HLH_MARKOV_FREE(node->children);
+         node->children = NULL;
+      }
+      else if(_HLH_markov_trie_capacity(children_used)<_HLH_markov_trie_capacity(node->children_used))
+      {
+         node->children = HLH_MARKOV_REALLOC(node->children,sizeof(*node->children)*_HLH_markov_trie_capacity(children_used));
+      }
+      node->children_used = children_used;
 
-   for(int i = 0;i<a->context_size;i++)
-      if(a->context[i]!=b->context[i])
-         return a->context[i]<b->context[i]?-1:1;
+      nodes->data[remap[i]] = *node;
+   }
+   HLH_MARKOV_FREE(remap);
 
-   return 0;
+   nodes->data_used = used;
+   int32_t data_size = 16;
+   while((uint32_t)data_size<used)
+      data_size*=2;
+   if(data_size<nodes->data_size)
+   {
+      nodes->data_size = data_size;
+      nodes->data = HLH_MARKOV_REALLOC(nodes->data,sizeof(*nodes->data)*nodes->data_size);
+   }
 }
 
-static HLH_markov_word_node *_HLH_markov_word_node_rotl(HLH_markov_word_node *root)
+static size_t _HLH_markov_model_word_size(const HLH_markov_model *model, size_t *sizes, int sizes_count)
 {
-   HLH_markov_word_node *r = root->right;
-   root->right = r->left;
-   r->left = root;
-
-   root->height = _HLH_markov_word_node_height(root);
-   r->height = _HLH_markov_word_node_height(r);
+   const HLH_markov_word_table *words = &model->as.mword.words;
+   const HLH_markov_context_word_table *table = &model->as.mword.contexts;
+   size_t size = 0;
+   size+=_HLH_markov_size_add(sizes,sizes_count,0,words->data_size*sizeof(words->data[0]));
+   size+=_HLH_markov_size_add(sizes,sizes_count,0,words->words_size*(sizeof(words->offsets[0])+sizeof(words->hashes[0])));
+   size+=_HLH_markov_size_add(sizes,sizes_count,0,words->slots_size*sizeof(words->slots[0]));
+   size+=_HLH_markov_size_add(sizes,sizes_count,0,table->slots_size*sizeof(table->slots[0]));
+   size+=_HLH_markov_size_add(sizes,sizes_count,0,model->as.mword.starts.counts.data_size*sizeof(HLH_markov_count));
+   for(int32_t i = 0;i<table->contexts.data_used;i++)
+   {
+      const HLH_markov_context_word *c = &table->contexts.data[i];
+      size+=_HLH_markov_size_add(sizes,sizes_count,c->context_size,sizeof(*c)+c->counts.data_size*sizeof(c->counts.data[0]));
+   }
+   return size;
+}
 
-   return r;
+static size_t _HLH_markov_model_char_size(const HLH_markov_model *model, size_t *sizes, int sizes_count)
+{
+   const HLH_markov_context_char_table *table = &model->as.mchar.contexts;
+   size_t size = 0;
+   size+=_HLH_markov_size_add(sizes,sizes_count,0,table->slots_size*sizeof(table->slots[0]));
+   size+=_HLH_markov_size_add(sizes,sizes_count,0,model->as.mchar.starts.counts.data_size*sizeof(HLH_markov_count));
+   for(int32_t i = 0;i<table->contexts.data_used;i++)
+   {
+      const HLH_markov_context_char *c = &table->contexts.data[i];
+      size_t context_size = sizeof(*c);
+      if(c->counts_used>HLH_MARKOV_SPARSE_MAX)
+         context_size+=256*sizeof(c->counts.dense[0]);
+      else
+         context_size+=c->counts_size*sizeof(c->counts.sparse[0]);
+      size+=_HLH_markov_size_add(sizes,sizes_count,c->context_size,context_size);
+   }
+   return size;
 }
 
-static HLH_markov_word_node *_HLH_markov_word_node_rotr(HLH_markov_word_node *root)
+//A node's depth is its order, the root belongs to order 0
+static size_t _HLH_markov_model_trie_size(const HLH_markov_model *model, size_t *sizes, int sizes_count)
 {
-   HLH_markov_word_node *l = root->left;
-   root->left = l->right;
-   l->right = root;
+   const HLH_markov_word_table *words = &model->as.mtrie.words;
+   const HLH_markov_trie_node_array *nodes = &model->as.mtrie.nodes;
+   size_t size = 0;
+   size+=_HLH_markov_size_add(sizes,sizes_count,0,words->data_size*sizeof(words->data[0]));
+   size+=_HLH_markov_size_add(sizes,sizes_count,0,words->words_size*(sizeof(words->offsets[0])+sizeof(words->hashes[0])));
+   size+=_HLH_markov_size_add(sizes,sizes_count,0,words->slots_size*sizeof(words->slots[0]));
+   size+=_HLH_markov_size_add(sizes,sizes_count,0,model->as.mtrie.starts.counts.data_size*sizeof(HLH_markov_count));
+
+   uint32_t path[HLH_MARKOV_ORDER_MAX+1];
+   uint32_t next[HLH_MARKOV_ORDER_MAX+1];
+   int depth = 0;
+   path[0] = 0;
+   next[0] = 0;
+   while(depth>=0)
+   {
+      const HLH_markov_trie_node *node = &nodes->data[path[depth]];
+      if(next[depth]==0)
+      {
+         size_t node_size = sizeof(*node);
+         node_size+=_HLH_markov_trie_capacity(node->counts_used)*sizeof(node->counts[0]);
+         node_size+=_HLH_markov_trie_capacity(node->children_used)*sizeof(node->children[0]);
+         size+=_HLH_markov_size_add(sizes,sizes_count,depth,node_size);
+      }
 
-   root->height = _HLH_markov_word_node_height(root);
-   l->height = _HLH_markov_word_node_height(l);
+      if(next[depth]==node->children_used)
+      {
+         depth--;
+         continue;
+      }
 
-   return l;
+      depth++;
+      path[depth] = node->children[next[depth-1]++].node;
+      next[depth] = 0;
+   }
+   return size;
 }
 
-static int _HLH_markov_word_node_height(const HLH_markov_word_node *root)
+//Everything but the contexts and their alias tables is shared
+static size_t _HLH_markov_model_frozen_size(const HLH_markov_frozen *frozen, size_t *sizes, int sizes_count)
 {
-   if(root==NULL)
-      return 0;
+   if(sizes_count==0)
+      return frozen->size;
 
-   int hl;
-   int hr;
+   const uint8_t *base = (const uint8_t *)frozen;
+   size_t shared = frozen->size;
+   for(uint64_t i = 0;i<frozen->contexts_used;i++)
+   {
+      const HLH_markov_frozen_context *c = (const HLH_markov_frozen_context *)(base+frozen->contexts+i*frozen->context_size);
+      size_t context_size = frozen->context_size+c->alias_count*sizeof(HLH_markov_alias);
+      shared-=_HLH_markov_size_add(sizes,sizes_count,c->key_size,context_size);
+   }
+   _HLH_markov_size_add(sizes,sizes_count,0,shared);
+   return frozen->size;
+}
 
-   if(root->left==NULL)
-      hl = 0;
-   else
-      hl = 1+root->left->height;
+//Adds size to the entry of order (if there is one), returns size
+static size_t _HLH_markov_size_add(size_t *sizes, int sizes_count, uint32_t order, size_t size)
+{
+   if(order<(uint32_t)sizes_count)
+      sizes[order]+=size;
+   return size;
+}
 
-   if(root->right==NULL)
-      hr = 0;
-   else
-      hr = 1+root->right->height;
+static uint32_t _HLH_markov_fnv32a(const char *str)
+{
+   uint32_t hval = 0x811c9dc5;
+   unsigned char *s = (unsigned char *)str;
+   while(*s) 
+   {
+      hval^=(uint32_t)*s++;
+      hval *= HLH_FNV_32_PRIME;
+   }
 
-   if(hl>hr)
-      return hl;
-   return hr;
+   return hval;
 }
 
-static HLH_markov_word_node *_HLH_markov_word_node_insert(HLH_markov_word_node *root, HLH_markov_word_node *node, HLH_markov_word_node **insert)
+//FNV-1a (64 bit) over the size and the characters of a context
+static uint64_t _HLH_markov_context_char_hash(const char *context, uint32_t context_size)
 {
-   if(root==NULL)
+   uint64_t hval = 0xcbf29ce484222325;
+   hval^=context_size;
+   hval*=HLH_FNV_64_PRIME;
+   for(uint32_t i = 0;i<context_size;i++)
    {
-      root = HLH_MARKOV_MALLOC(sizeof(*root));
-      memcpy(root,node,sizeof(*node));
-      *insert = root;
+      hval^=(unsigned char)context[i];
+      hval*=HLH_FNV_64_PRIME;
    }
-   else if(_HLH_markov_word_node_cmp(root,node)<0)
-   {
-      root->right = _HLH_markov_word_node_insert(root->right,node,insert);
 
-      if(_HLH_markov_word_node_balance(root)==-2)
-      {
-         if(_HLH_markov_word_node_cmp(node,root->right)>0)
-         {
-            root = _HLH_markov_word_node_rotl(root);
-         }
-         else
-         {
-            root->right = _HLH_markov_word_node_rotr(root->right);
-            root = _HLH_markov_word_node_rotl(root);
-         }
-      }
-   }
-   else if(_HLH_markov_word_node_cmp(root,node)>0)
-   {
-      root->left = _HLH_markov_word_node_insert(root->left,node,insert);
+   //Mix the high bits into the low ones, which pick the slot
+   return hval^(hval>>32);
+}
 
-      if(_HLH_markov_word_node_balance(root)==2)
-      {
-         if(_HLH_markov_word_node_cmp(node,root->left)<0)
-         {
-            root = _HLH_markov_word_node_rotr(root);
-         }
-         else
-         {
-            root->left = _HLH_markov_word_node_rotl(root->left);
-            root = _HLH_markov_word_node_rotr(root);
-         }
-      }
-   }
-   else
+//FNV-1a (64 bit) over the size and the word ids of a context,
+//whole ids are mixed in at once instead of single bytes
+static uint64_t _HLH_markov_context_word_hash(const uint32_t *context, uint32_t context_size)
+{
+   uint64_t hval = 0xcbf29ce484222325;
+   hval^=context_size;
+   hval*=HLH_FNV_64_PRIME;
+   for(uint32_t i = 0;i<context_size;i++)
    {
-      *insert = root;
+      hval^=context[i];
+      hval*=HLH_FNV_64_PRIME;
    }
 
-   root->height = _HLH_markov_word_node_height(root);
-   return root;
+   return hval^(hval>>32);
 }
 
-static int _HLH_markov_word_node_balance(const HLH_markov_word_node *root)
+//xoshiro256**
+static uint64_t _HLH_markov_rng_next(HLH_markov_rng *rng)
 {
-   int hl;
-   int hr;
-
-   if(root->left==NULL)
-      hl = 0;
-   else
-      hl = 1+root->left->height;
+   uint64_t *st = rng->s;
+   uint64_t x = st[1]*5;
+   uint64_t result = ((x<<7)|(x>>57))*9;
+   uint64_t t = st[1]<<17;
+
+   st[2]^=st[0];
+   st[3]^=st[1];
+   st[1]^=st[2];
+   st[0]^=st[3];
+   st[2]^=t;
+   st[3] = (st[3]<<45)|(st[3]>>19);
+
+   return result;
+}
 
-   if(root->right==NULL)
-      hr = 0;
-   else
-      hr = 1+root->right->height;
+//Random number below bound, from rng or HLH_MARKOV_RAND() if rng is NULL
+static uint32_t _HLH_markov_rand(HLH_markov_rng *rng, uint32_t bound)
+{
+   if(rng==NULL)
+      return HLH_MARKOV_RAND()%bound;
 
-   return hl-hr;
+   //Multiply instead of modulo, the bias is negligible for 32 bit bounds
+   return (uint32_t)(((_HLH_markov_rng_next(rng)>>32)*bound)>>32);
 }
 
-static HLH_markov_word_node *_HLH_markov_word_node_search(HLH_markov_word_node *root, uint32_t context[HLH_MARKOV_ORDER_WORD], uint32_t context_size)
+//src keeps the position between calls
+static char *_HLH_markov_strtok(char *s, const char *sep, char **src)
 {
-   HLH_markov_word_node n = {0};
-   memcpy(&n.context,context,sizeof(*context)*context_size);
-   n.context_size = context_size;
-   n.total = 0;
-   memset(&n.counts,0,sizeof(n.counts));
+   char *p;
+
+   if(s==NULL)
+      s = *src;
 
-   if(root==NULL)
+   while(*s&&strchr(sep,*s)!=NULL)
+      s++;
+
+   if(!*s)
       return NULL;
-   int cmp = _HLH_markov_word_node_cmp(&n,root);
 
-   if(cmp>0)
-      return _HLH_markov_word_node_search(root->right,context,context_size);
-   else if(cmp<0)
-      return _HLH_markov_word_node_search(root->left,context,context_size);
-   return root;
-}
+   for(p = s;*s&&!strchr(sep,*s);s++);
 
-static int _HLH_markov_word_node_count(HLH_markov_word_node *root)
-{
-   int count = 0;
-   if(root->left!=NULL)
-      count+=_HLH_markov_word_node_count(root->left);
-   if(root->right!=NULL)
-      count+=_HLH_markov_word_node_count(root->right);
-   return count+1;
+   if(*s&&s[1])
+      *(s++) = 0;
+
+   *src = s;
+
+   return p;
 }
 
+#undef HLH_MARKOV_FROZEN_MAGIC
+#undef HLH_MARKOV_FROZEN_VERSION
 #undef HLH_FNV_32_PRIME 
+#undef HLH_FNV_64_PRIME
 #endif
 #endif